@@ -0,0 +1,274 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "benchmark.h"
+#include "peer.h"
+#include "responsehandler.h"
+#include "cbor.h"
+
+#include <QAtomicInt>
+#include <QVariantList>
+
+#include <qt-json/json.h>
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace JsonRPC;
+
+namespace {
+
+// counts every allocation of the process, the checks read it before and
+// after handling the messages
+QAtomicInt allocations;
+
+} // namespace
+
+void *operator new(size_t size)
+{
+    allocations.ref();
+
+    void *pointer = malloc(size ? size : 1);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *pointer) throw()
+{
+    free(pointer);
+}
+
+void operator delete[](void *pointer) throw()
+{
+    free(pointer);
+}
+
+namespace {
+
+// the first messages fill the handler pool and the lazily created data
+const int WARM_UP_MESSAGES = 16;
+const int MEASURED_MESSAGES = 64;
+
+const int SMALL_PAYLOAD = 1;
+const int LARGE_PAYLOAD = 2048;
+
+QVariant payload(int records)
+{
+    QVariantList list;
+
+    for (int i = 0;i != records;++i) {
+        QVariantMap record;
+        record.insert("id", i);
+        record.insert("name", QString("record %1").arg(i));
+        record.insert("value", i * 0.25);
+        list.push_back(record);
+    }
+
+    return list;
+}
+
+QByteArray requestMessage(int records, bool notification,
+                          Peer::Encoding encoding)
+{
+    QVariantMap request;
+    request.insert("jsonrpc", "2.0");
+    request.insert("method", "noop");
+    request.insert("params", payload(records));
+    if (!notification)
+        request.insert("id", 1);
+
+    if (encoding == Peer::CBOR_ENCODING)
+        return Cbor::serialize(request);
+    else
+        return QtJson::Json::serialize(request);
+}
+
+QVariant resultResponse(int records)
+{
+    QVariantMap response;
+    response.insert("jsonrpc", "2.0");
+    response.insert("result", payload(records));
+    response.insert("id", 1);
+    return response;
+}
+
+QVariant errorResponse(int records)
+{
+    QVariantMap error;
+    error.insert("code", -32000);
+    error.insert("message", "Server error");
+    error.insert("data", payload(records));
+
+    QVariantMap response;
+    response.insert("jsonrpc", "2.0");
+    response.insert("error", error);
+    response.insert("id", 1);
+    return response;
+}
+
+class NoopMethod: public AbstractMethod
+{
+public:
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        handler->response(QVariant());
+    }
+};
+
+class HandleMessageOperation: public BenchmarkOperation
+{
+public:
+    HandleMessageOperation(Peer &peer, const QByteArray &message,
+                           Peer::Encoding encoding) :
+        peer(peer),
+        message(message),
+        encoding(encoding)
+    {
+    }
+
+    qint64 run(int iterations)
+    {
+        for (int i = 0;i != iterations;++i)
+            peer.handleMessage(message, encoding);
+
+        return 0;
+    }
+
+private:
+    Peer &peer;
+    const QByteArray message;
+    const Peer::Encoding encoding;
+};
+
+class HandleResponseOperation: public BenchmarkOperation
+{
+public:
+    HandleResponseOperation(Peer &peer, const QVariant &json) :
+        peer(peer),
+        json(json)
+    {
+    }
+
+    qint64 run(int iterations)
+    {
+        for (int i = 0;i != iterations;++i)
+            peer.handleResponse(json);
+
+        return 0;
+    }
+
+private:
+    Peer &peer;
+    const QVariant json;
+};
+
+// returns the allocations made by each run of operation, or -1 if the
+// runs don't allocate the same number of times
+int allocationsPerMessage(BenchmarkOperation &operation)
+{
+    operation.run(WARM_UP_MESSAGES);
+
+    int counts[2];
+    for (int i = 0;i != 2;++i) {
+        const int before = allocations;
+        operation.run(MEASURED_MESSAGES);
+        counts[i] = int(allocations) - before;
+    }
+
+    if (counts[0] != counts[1] || counts[0] % MEASURED_MESSAGES)
+        return -1;
+
+    return counts[0] / MEASURED_MESSAGES;
+}
+
+// The messages are shared, never copied nor detached, so the number of
+// allocations of a message doesn't depend on the size of its payload.
+// The params of the requests aren't decoded (see Peer::setLazyParams).
+bool check(const QString &name, BenchmarkOperation &small,
+           BenchmarkOperation &large)
+{
+    const int smallCount = allocationsPerMessage(small);
+    const int largeCount = allocationsPerMessage(large);
+    const bool passed = smallCount != -1 && smallCount == largeCount;
+
+    QVariantMap result;
+    result.insert("check", name);
+    result.insert("allocationsPerMessage", smallCount);
+    result.insert("allocationsPerLargeMessage", largeCount);
+    result.insert("passed", passed);
+
+    // one object per line, like the benchmark results
+    const QByteArray line = QtJson::Json::serialize(result);
+    fwrite(line.constData(), 1, line.size(), stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+
+    return passed;
+}
+
+const char *encodingName(Peer::Encoding encoding)
+{
+    return encoding == Peer::CBOR_ENCODING ? "cbor" : "json";
+}
+
+} // namespace
+
+bool runAllocationChecks()
+{
+    bool passed = true;
+
+    const Peer::Encoding encodings[] = {
+        Peer::JSON_ENCODING,
+        Peer::CBOR_ENCODING
+    };
+
+    for (int e = 0;e != 2;++e) {
+        Peer peer;
+        peer.setEncoding(encodings[e]);
+        peer.registerMethod("noop", new NoopMethod);
+
+        const QString suffix(encodingName(encodings[e]));
+
+        HandleMessageOperation smallRequest(peer,
+                                            requestMessage(SMALL_PAYLOAD, false,
+                                                           encodings[e]),
+                                            encodings[e]);
+        HandleMessageOperation largeRequest(peer,
+                                            requestMessage(LARGE_PAYLOAD, false,
+                                                           encodings[e]),
+                                            encodings[e]);
+        passed &= check("allocations.request." + suffix, smallRequest,
+                        largeRequest);
+
+        HandleMessageOperation smallNotification(peer,
+                                                 requestMessage(SMALL_PAYLOAD,
+                                                                true,
+                                                                encodings[e]),
+                                                 encodings[e]);
+        HandleMessageOperation largeNotification(peer,
+                                                 requestMessage(LARGE_PAYLOAD,
+                                                                true,
+                                                                encodings[e]),
+                                                 encodings[e]);
+        passed &= check("allocations.notification." + suffix,
+                        smallNotification, largeNotification);
+    }
+
+    Peer peer;
+
+    HandleResponseOperation smallResult(peer, resultResponse(SMALL_PAYLOAD));
+    HandleResponseOperation largeResult(peer, resultResponse(LARGE_PAYLOAD));
+    passed &= check("allocations.response.result", smallResult, largeResult);
+
+    HandleResponseOperation smallError(peer, errorResponse(SMALL_PAYLOAD));
+    HandleResponseOperation largeError(peer, errorResponse(LARGE_PAYLOAD));
+    passed &= check("allocations.response.error", smallError, largeError);
+
+    return passed;
+}
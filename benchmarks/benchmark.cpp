@@ -0,0 +1,86 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "benchmark.h"
+
+#include <QElapsedTimer>
+
+#include <qt-json/json.h>
+
+#include <stdio.h>
+
+BenchmarkOperation::~BenchmarkOperation()
+{
+}
+
+BenchmarkRunner::BenchmarkRunner(const QStringList &filters, int minTime) :
+    filters(filters),
+    m_minTime(minTime)
+{
+}
+
+bool BenchmarkRunner::isSelected(const QString &name) const
+{
+    if (filters.isEmpty())
+        return true;
+
+    Q_FOREACH (const QString &filter, filters) {
+        if (name.startsWith(filter))
+            return true;
+    }
+
+    return false;
+}
+
+int BenchmarkRunner::minTime() const
+{
+    return m_minTime;
+}
+
+void BenchmarkRunner::measure(const QString &name,
+                              BenchmarkOperation &operation,
+                              const QVariantMap &extra)
+{
+    if (!isSelected(name))
+        return;
+
+    const qint64 minTime = qint64(m_minTime) * 1000000;
+    int iterations = 1;
+
+    while (true) {
+        QElapsedTimer timer;
+        timer.start();
+        const qint64 bytes = operation.run(iterations);
+        const qint64 nsecs = timer.nsecsElapsed();
+
+        if (nsecs >= minTime || iterations >= 0x40000000) {
+            report(name, iterations, nsecs, bytes, extra);
+            return;
+        }
+
+        iterations *= 2;
+    }
+}
+
+void BenchmarkRunner::report(const QString &name, qint64 iterations,
+                             qint64 nsecs, qint64 bytes,
+                             const QVariantMap &extra)
+{
+    if (!iterations || !nsecs)
+        return;
+
+    QVariantMap result(extra);
+
+    result.insert("benchmark", name);
+    result.insert("iterations", iterations);
+    result.insert("nsPerOp", double(nsecs) / iterations);
+    result.insert("opsPerSec", iterations * 1e9 / nsecs);
+
+    if (bytes)
+        result.insert("bytesPerSec", bytes * 1e9 / nsecs);
+
+    // one object per line
+    const QByteArray line = QtJson::Json::serialize(result);
+    fwrite(line.constData(), 1, line.size(), stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+}
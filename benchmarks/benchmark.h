@@ -0,0 +1,87 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_BENCHMARK_H
+#define QTJSONRPC_BENCHMARK_H
+
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+
+/*!
+  An operation measured by the BenchmarkRunner.
+  */
+class BenchmarkOperation
+{
+public:
+    virtual ~BenchmarkOperation();
+
+    /*!
+      Runs the operation \param iterations times.
+      @return the number of bytes processed, or 0 if it doesn't apply.
+      */
+    virtual qint64 run(int iterations) = 0;
+};
+
+/*!
+  Runs the benchmarks and writes one JSON object per result to the
+  standard output, so the results can be compared between releases.
+
+  Each result has the fields:
+  - "benchmark": the name of the benchmark
+  - "iterations": the number of measured operations
+  - "nsPerOp": the average time of each operation, in nanoseconds
+  - "opsPerSec": the throughput, in operations per second
+  - "bytesPerSec": the throughput in bytes, when it applies
+  and any extra field given by the benchmark.
+  */
+class BenchmarkRunner
+{
+public:
+    /*!
+      \param filters are the name prefixes of the benchmarks to run. All
+      of them are run if \param filters is empty.
+      Each benchmark runs for at least \param minTime milliseconds.
+      */
+    BenchmarkRunner(const QStringList &filters, int minTime);
+
+    /*!
+      @return true if the benchmark \param name must be run.
+      */
+    bool isSelected(const QString &name) const;
+    /*!
+      @return the minimum time of each benchmark, in milliseconds.
+      */
+    int minTime() const;
+
+    /*!
+      Runs \param operation until it takes at least minTime and reports
+      the result as \param name. The iterations are doubled each run, so
+      timer overhead and warm-up are not measured.
+      */
+    void measure(const QString &name, BenchmarkOperation &operation,
+                 const QVariantMap &extra = QVariantMap());
+    /*!
+      Reports the result of a benchmark that measures itself.
+      */
+    void report(const QString &name, qint64 iterations, qint64 nsecs,
+                qint64 bytes = 0, const QVariantMap &extra = QVariantMap());
+
+private:
+    QStringList filters;
+    int m_minTime;
+};
+
+void runCoreBenchmarks(BenchmarkRunner &runner);
+void runTransportBenchmarks(BenchmarkRunner &runner);
+
+/*!
+  Counts the allocations made to handle requests, notifications and
+  responses with small and large payloads and writes one JSON object per
+  check to the standard output.
+  @return false if the count of a message depends on its payload, which
+  means it's copied or detached, or if it isn't the same for every
+  message.
+  */
+bool runAllocationChecks();
+
+#endif // QTJSONRPC_BENCHMARK_H
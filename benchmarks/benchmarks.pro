@@ -0,0 +1,12 @@
+TARGET = benchmarks
+TEMPLATE = app
+
+QT -= gui
+CONFIG += console
+CONFIG -= app_bundle
+
+include(../qt-json-rpc.pri)
+
+SOURCES += main.cpp benchmark.cpp corebenchmarks.cpp transportbenchmarks.cpp \
+        allocationchecks.cpp
+HEADERS += benchmark.h transportbenchmarks.h
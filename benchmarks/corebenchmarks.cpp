@@ -0,0 +1,277 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "benchmark.h"
+#include "peer.h"
+#include "responsehandler.h"
+#include "error.h"
+#include "cbor.h"
+
+#include <QVariantList>
+
+#include <qt-json/json.h>
+
+using namespace JsonRPC;
+
+namespace {
+
+struct PayloadSize
+{
+    const char *name;
+    int records;
+};
+
+const PayloadSize payloadSizes[] = {
+    {"small", 1},
+    {"medium", 32},
+    {"large", 2048}
+};
+
+QVariant payload(int records)
+{
+    QVariantList list;
+
+    for (int i = 0;i != records;++i) {
+        QVariantMap record;
+        record.insert("id", i);
+        record.insert("name", QString("record %1").arg(i));
+        record.insert("value", i * 0.25);
+        record.insert("enabled", i % 2 == 0);
+        list.push_back(record);
+    }
+
+    return list;
+}
+
+QByteArray encode(const QVariant &message, Peer::Encoding encoding)
+{
+    if (encoding == Peer::CBOR_ENCODING)
+        return Cbor::serialize(message);
+    else
+        return QtJson::Json::serialize(message);
+}
+
+QByteArray requestMessage(int records, Peer::Encoding encoding)
+{
+    QVariantMap request;
+    request.insert("jsonrpc", "2.0");
+    request.insert("method", "noop");
+    request.insert("params", payload(records));
+    request.insert("id", 1);
+    return encode(request, encoding);
+}
+
+QByteArray responseMessage(int records, Peer::Encoding encoding)
+{
+    QVariantMap response;
+    response.insert("jsonrpc", "2.0");
+    response.insert("result", payload(records));
+    response.insert("id", 1);
+    return encode(response, encoding);
+}
+
+QVariantMap resultObject(const QVariant &result, int id)
+{
+    QVariantMap response;
+    response.insert("jsonrpc", "2.0");
+    response.insert("result", result);
+    response.insert("id", id);
+    return response;
+}
+
+QVariant errorObject()
+{
+    QVariantMap error;
+    error.insert("code", int(INTERNAL_ERROR));
+    error.insert("message", "Internal error");
+    error.insert("data", payload(1));
+
+    QVariantMap response;
+    response.insert("jsonrpc", "2.0");
+    response.insert("error", error);
+    response.insert("id", 1);
+    return response;
+}
+
+QVariant batchObject(int responses)
+{
+    QVariantList batch;
+    for (int i = 0;i != responses;++i)
+        batch.push_back(resultObject(i, i));
+    return batch;
+}
+
+class NoopMethod: public AbstractMethod
+{
+public:
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        handler->response(QVariant());
+    }
+};
+
+class HandleMessageOperation: public BenchmarkOperation
+{
+public:
+    HandleMessageOperation(Peer &peer, const QByteArray &message,
+                           Peer::Encoding encoding) :
+        peer(peer),
+        message(message),
+        encoding(encoding)
+    {
+    }
+
+    qint64 run(int iterations)
+    {
+        for (int i = 0;i != iterations;++i)
+            peer.handleMessage(message, encoding);
+
+        return qint64(message.size()) * iterations;
+    }
+
+private:
+    Peer &peer;
+    const QByteArray message;
+    const Peer::Encoding encoding;
+};
+
+class ResponseOperation: public BenchmarkOperation
+{
+public:
+    ResponseOperation(Peer &peer, const QVariant &result) :
+        peer(peer),
+        result(result)
+    {
+    }
+
+    qint64 run(int iterations)
+    {
+        for (int i = 0;i != iterations;++i) {
+            ResponseHandler handler(&peer);
+            handler.setMethod("noop");
+            handler.setId(i);
+            handler.response(result);
+        }
+
+        return 0;
+    }
+
+private:
+    Peer &peer;
+    const QVariant result;
+};
+
+// the responses are already decoded, so only their reading is measured:
+// a single response isn't copied into a list and the objects aren't
+// detached
+class HandleResponseOperation: public BenchmarkOperation
+{
+public:
+    HandleResponseOperation(Peer &peer, const QVariant &json) :
+        peer(peer),
+        json(json)
+    {
+    }
+
+    qint64 run(int iterations)
+    {
+        for (int i = 0;i != iterations;++i)
+            peer.handleResponse(json);
+
+        return 0;
+    }
+
+private:
+    Peer &peer;
+    const QVariant json;
+};
+
+class ErrorOperation: public BenchmarkOperation
+{
+public:
+    qint64 run(int iterations)
+    {
+        static const ErrorCode codes[] = {
+            PARSE_ERROR,
+            INVALID_REQUEST,
+            METHOD_NOT_FOUND,
+            INVALID_PARAMS,
+            INTERNAL_ERROR
+        };
+        static const int size = sizeof(codes) / sizeof(codes[0]);
+
+        qint64 bytes = 0;
+        for (int i = 0;i != iterations;++i)
+            bytes += static_cast<QByteArray>(Error(codes[i % size])).size();
+
+        return bytes;
+    }
+};
+
+const char *encodingName(Peer::Encoding encoding)
+{
+    return encoding == Peer::CBOR_ENCODING ? "cbor" : "json";
+}
+
+} // namespace
+
+void runCoreBenchmarks(BenchmarkRunner &runner)
+{
+    const int sizes = sizeof(payloadSizes) / sizeof(payloadSizes[0]);
+    const Peer::Encoding encodings[] = {
+        Peer::JSON_ENCODING,
+        Peer::CBOR_ENCODING
+    };
+
+    for (int e = 0;e != 2;++e) {
+        Peer peer;
+        peer.setEncoding(encodings[e]);
+        peer.registerMethod("noop", new NoopMethod);
+
+        for (int i = 0;i != sizes;++i) {
+            const QString suffix = QString("%1.%2")
+                    .arg(payloadSizes[i].name, encodingName(encodings[e]));
+            QVariantMap extra;
+            extra.insert("records", payloadSizes[i].records);
+
+            HandleMessageOperation request(peer,
+                                           requestMessage(payloadSizes[i].records,
+                                                          encodings[e]),
+                                           encodings[e]);
+            runner.measure("peer.handleMessage.request." + suffix, request,
+                           extra);
+
+            HandleMessageOperation response(peer,
+                                            responseMessage(payloadSizes[i].records,
+                                                            encodings[e]),
+                                            encodings[e]);
+            runner.measure("peer.handleMessage.response." + suffix, response,
+                           extra);
+
+            ResponseOperation reply(peer, payload(payloadSizes[i].records));
+            runner.measure("responseHandler.response." + suffix, reply,
+                           extra);
+        }
+    }
+
+    Peer peer;
+    for (int i = 0;i != sizes;++i) {
+        const QString suffix(payloadSizes[i].name);
+        QVariantMap extra;
+        extra.insert("records", payloadSizes[i].records);
+
+        HandleResponseOperation result(peer,
+                                       resultObject(payload(payloadSizes[i].records),
+                                                    1));
+        runner.measure("peer.handleResponse.result." + suffix, result, extra);
+
+        HandleResponseOperation batch(peer,
+                                      batchObject(payloadSizes[i].records));
+        runner.measure("peer.handleResponse.batch." + suffix, batch, extra);
+    }
+
+    HandleResponseOperation errorResponse(peer, errorObject());
+    runner.measure("peer.handleResponse.error", errorResponse);
+
+    ErrorOperation error;
+    runner.measure("error.serialize", error);
+}
@@ -0,0 +1,60 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include <QCoreApplication>
+#include <QStringList>
+
+#include <stdio.h>
+
+#include "benchmark.h"
+
+static void usage()
+{
+    fputs("usage: benchmarks [-t MSECS] [PREFIX...]\n"
+          "       benchmarks -a\n"
+          "\n"
+          "Runs the benchmarks whose names start with one of the PREFIXes\n"
+          "(all of them by default), each one for at least MSECS\n"
+          "milliseconds (500 by default), and prints one JSON object per\n"
+          "result.\n"
+          "With -a, runs the allocation checks instead and exits with 1 if\n"
+          "one of them fails.\n", stderr);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    arguments.removeFirst();
+
+    QStringList filters;
+    int minTime = 500;
+
+    while (!arguments.isEmpty()) {
+        const QString argument = arguments.takeFirst();
+
+        if (argument == "-t" && !arguments.isEmpty()) {
+            bool ok;
+            minTime = arguments.takeFirst().toInt(&ok);
+            if (!ok || minTime <= 0) {
+                usage();
+                return 1;
+            }
+        } else if (argument == "-a" && arguments.isEmpty()
+                   && filters.isEmpty()) {
+            return runAllocationChecks() ? 0 : 1;
+        } else if (argument.startsWith('-')) {
+            usage();
+            return argument == "-h" || argument == "--help" ? 0 : 1;
+        } else {
+            filters.push_back(argument);
+        }
+    }
+
+    BenchmarkRunner runner(filters, minTime);
+
+    runCoreBenchmarks(runner);
+    runTransportBenchmarks(runner);
+
+    return 0;
+}
@@ -0,0 +1,364 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "transportbenchmarks.h"
+#include "benchmark.h"
+#include "tcphelper.h"
+#include "tcpserver.h"
+#include "httphelper.h"
+#include "httpserver.h"
+#include "responsehandler.h"
+
+#include <QCoreApplication>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUrl>
+
+using namespace JsonRPC;
+
+namespace {
+
+// gives up when no response arrives for this long
+const int STALL_TIMEOUT = 5000;
+
+class EchoMethod: public AbstractMethod
+{
+public:
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        handler->response(handler->params());
+    }
+};
+
+class TcpRoundTripClient: public RoundTripClient
+{
+public:
+    TcpRoundTripClient(int depth, int minTime) :
+        RoundTripClient(depth, minTime)
+    {
+        connect(&helper, SIGNAL(readyResponse(QVariant,QVariant)),
+                this, SLOT(onResponse(QVariant,QVariant)));
+        connect(&helper, SIGNAL(requestError(int,QString,QVariant,QVariant)),
+                this, SLOT(onError(int,QString,QVariant,QVariant)));
+    }
+
+    TcpHelper helper;
+
+protected:
+    bool call(const QVariant &params, const QVariant &id)
+    {
+        return helper.call("echo", params, id);
+    }
+};
+
+class HttpRoundTripClient: public RoundTripClient
+{
+public:
+    HttpRoundTripClient(int depth, int minTime) :
+        RoundTripClient(depth, minTime)
+    {
+        connect(&helper, SIGNAL(readyResponse(QVariant,QVariant)),
+                this, SLOT(onResponse(QVariant,QVariant)));
+        connect(&helper, SIGNAL(requestError(int,QString,QVariant,QVariant)),
+                this, SLOT(onError(int,QString,QVariant,QVariant)));
+    }
+
+    HttpHelper helper;
+
+protected:
+    bool call(const QVariant &params, const QVariant &id)
+    {
+        return helper.call("echo", params, id);
+    }
+};
+
+struct TcpVariant
+{
+    const char *name;
+    TcpHelper::Framing framing;
+    Peer::Encoding encoding;
+};
+
+const TcpVariant tcpVariants[] = {
+    {"json", TcpHelper::FRAMING_16BIT, Peer::JSON_ENCODING},
+    {"cbor", TcpHelper::FRAMING_32BIT, Peer::CBOR_ENCODING}
+};
+
+const int tcpDepths[] = {1, 16, 128};
+
+struct HttpVariant
+{
+    const char *name;
+    int depth;
+    bool batching;
+};
+
+// QNetworkAccessManager opens up to 6 connections per host
+const HttpVariant httpVariants[] = {
+    {"depth1", 1, false},
+    {"depth6", 6, false},
+    {"batch32", 32, true}
+};
+
+void report(BenchmarkRunner &runner, const QString &name,
+            const RoundTripClient &client, int depth)
+{
+    QVariantMap extra;
+    extra.insert("depth", depth);
+    extra.insert("rounds", client.rounds());
+    extra.insert("nsPerRound", double(client.elapsed()) / client.rounds());
+
+    runner.report(name, client.calls(), client.elapsed(), 0, extra);
+}
+
+bool waitForEncoding(const TcpHelper &helper, Peer::Encoding encoding)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    while (helper.activeEncoding() != encoding) {
+        if (timer.elapsed() > STALL_TIMEOUT)
+            return false;
+
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+    }
+
+    return true;
+}
+
+void runTcpBenchmark(BenchmarkRunner &runner, const TcpVariant &variant,
+                     int depth)
+{
+    const QString name = QString("tcp.roundtrip.%1.depth%2")
+            .arg(variant.name).arg(depth);
+
+    if (!runner.isSelected(name))
+        return;
+
+    TcpServer server;
+    server.setThreadCount(1);
+    server.setFraming(variant.framing);
+    server.setEncoding(variant.encoding);
+    server.registerMethod("echo", new EchoMethod);
+
+    if (!server.listen(QHostAddress::LocalHost)) {
+        qWarning("%s: listen failed", qPrintable(name));
+        return;
+    }
+
+    QTcpSocket *socket = new QTcpSocket;
+    socket->connectToHost(QHostAddress::LocalHost, server.serverPort());
+
+    if (!socket->waitForConnected(STALL_TIMEOUT)) {
+        qWarning("%s: connection failed", qPrintable(name));
+        delete socket;
+        return;
+    }
+
+    TcpRoundTripClient client(depth, runner.minTime());
+    client.helper.setFraming(variant.framing);
+    client.helper.setEncoding(variant.encoding);
+    client.helper.setSocket(socket);
+
+    if (!waitForEncoding(client.helper, variant.encoding)) {
+        qWarning("%s: encoding negotiation failed", qPrintable(name));
+        return;
+    }
+
+    if (client.run())
+        report(runner, name, client, depth);
+    else
+        qWarning("%s: failed", qPrintable(name));
+}
+
+void runLocalBenchmark(BenchmarkRunner &runner, const TcpVariant &variant,
+                       int depth)
+{
+    const QString name = QString("local.roundtrip.%1.depth%2")
+            .arg(variant.name).arg(depth);
+
+    if (!runner.isSelected(name))
+        return;
+
+    const QString serverName = QString("qt-json-rpc-benchmark-%1")
+            .arg(QCoreApplication::applicationPid());
+
+    TcpServer server;
+    server.setThreadCount(1);
+    server.setFraming(variant.framing);
+    server.setEncoding(variant.encoding);
+    server.registerMethod("echo", new EchoMethod);
+
+    QLocalServer::removeServer(serverName);
+    if (!server.listenLocal(serverName)) {
+        qWarning("%s: listen failed", qPrintable(name));
+        return;
+    }
+
+    QLocalSocket *socket = new QLocalSocket;
+    socket->connectToServer(serverName);
+
+    if (!socket->waitForConnected(STALL_TIMEOUT)) {
+        qWarning("%s: connection failed", qPrintable(name));
+        delete socket;
+        return;
+    }
+
+    TcpRoundTripClient client(depth, runner.minTime());
+    client.helper.setFraming(variant.framing);
+    client.helper.setEncoding(variant.encoding);
+    client.helper.setLocalSocket(socket);
+
+    if (!waitForEncoding(client.helper, variant.encoding)) {
+        qWarning("%s: encoding negotiation failed", qPrintable(name));
+        return;
+    }
+
+    if (client.run())
+        report(runner, name, client, depth);
+    else
+        qWarning("%s: failed", qPrintable(name));
+}
+
+void runHttpBenchmark(BenchmarkRunner &runner, const HttpVariant &variant)
+{
+    const QString name = QString("http.roundtrip.%1").arg(variant.name);
+
+    if (!runner.isSelected(name))
+        return;
+
+    HttpServer server;
+    server.setThreadCount(1);
+    server.registerMethod("echo", new EchoMethod);
+
+    if (!server.listen(QHostAddress::LocalHost)) {
+        qWarning("%s: listen failed", qPrintable(name));
+        return;
+    }
+
+    HttpRoundTripClient client(variant.depth, runner.minTime());
+    client.helper.setUrl(QUrl(QString("http://127.0.0.1:%1/")
+                              .arg(server.serverPort())));
+    client.helper.setBatching(variant.batching);
+    client.helper.setMaxBatchSize(variant.depth);
+
+    if (client.run())
+        report(runner, name, client, variant.depth);
+    else
+        qWarning("%s: failed", qPrintable(name));
+}
+
+} // namespace
+
+RoundTripClient::RoundTripClient(int depth, int minTime, QObject *parent) :
+    QObject(parent),
+    depth(depth),
+    minTime(qint64(minTime) * 1000000),
+    m_calls(0),
+    m_rounds(0),
+    m_elapsed(0),
+    lastProgress(0),
+    outstanding(0),
+    failed(false)
+{
+}
+
+bool RoundTripClient::run()
+{
+    QTimer stallTimer;
+    connect(&stallTimer, SIGNAL(timeout()), this, SLOT(onTimeout()));
+    stallTimer.start(STALL_TIMEOUT);
+
+    timer.start();
+    sendRound();
+
+    if (!failed)
+        loop.exec();
+
+    return !failed && m_rounds;
+}
+
+qint64 RoundTripClient::calls() const
+{
+    return m_calls;
+}
+
+qint64 RoundTripClient::rounds() const
+{
+    return m_rounds;
+}
+
+qint64 RoundTripClient::elapsed() const
+{
+    return m_elapsed;
+}
+
+void RoundTripClient::onResponse(QVariant, QVariant)
+{
+    ++m_calls;
+
+    if (--outstanding)
+        return;
+
+    ++m_rounds;
+
+    const qint64 elapsed = timer.nsecsElapsed();
+    if (elapsed >= minTime) {
+        m_elapsed = elapsed;
+        loop.quit();
+    } else {
+        sendRound();
+    }
+}
+
+void RoundTripClient::onError(int, QString message, QVariant, QVariant)
+{
+    qWarning("call failed: %s", qPrintable(message));
+    failed = true;
+    loop.quit();
+}
+
+void RoundTripClient::onTimeout()
+{
+    if (m_calls != lastProgress) {
+        lastProgress = m_calls;
+        return;
+    }
+
+    failed = true;
+    loop.quit();
+}
+
+void RoundTripClient::sendRound()
+{
+    outstanding = depth;
+
+    for (int i = 0;i != depth;++i) {
+        if (!call(QVariantList() << i, m_calls + i)) {
+            failed = true;
+            loop.quit();
+            return;
+        }
+    }
+}
+
+void runTransportBenchmarks(BenchmarkRunner &runner)
+{
+    const int variants = sizeof(tcpVariants) / sizeof(tcpVariants[0]);
+    const int depths = sizeof(tcpDepths) / sizeof(tcpDepths[0]);
+
+    for (int v = 0;v != variants;++v) {
+        for (int d = 0;d != depths;++d)
+            runTcpBenchmark(runner, tcpVariants[v], tcpDepths[d]);
+    }
+
+    for (int v = 0;v != variants;++v) {
+        for (int d = 0;d != depths;++d)
+            runLocalBenchmark(runner, tcpVariants[v], tcpDepths[d]);
+    }
+
+    const int httpCount = sizeof(httpVariants) / sizeof(httpVariants[0]);
+    for (int i = 0;i != httpCount;++i)
+        runHttpBenchmark(runner, httpVariants[i]);
+}
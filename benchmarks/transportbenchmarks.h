@@ -0,0 +1,58 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_TRANSPORTBENCHMARKS_H
+#define QTJSONRPC_TRANSPORTBENCHMARKS_H
+
+#include <QElapsedTimer>
+#include <QEventLoop>
+
+#include "peer.h"
+
+/*!
+  Keeps \a depth calls in flight and measures how many round trips are
+  completed. Each round sends \a depth calls and the next round starts
+  when all of them are answered.
+  */
+class RoundTripClient: public QObject
+{
+    Q_OBJECT
+public:
+    RoundTripClient(int depth, int minTime, QObject *parent = 0);
+
+    /*!
+      Runs the rounds until minTime is reached.
+      @return false if a call failed or the responses stopped arriving.
+      */
+    bool run();
+
+    qint64 calls() const;
+    qint64 rounds() const;
+    qint64 elapsed() const;
+
+public slots:
+    void onResponse(QVariant result, QVariant id);
+    void onError(int code, QString message, QVariant data, QVariant id);
+
+protected:
+    virtual bool call(const QVariant &params, const QVariant &id) = 0;
+
+private slots:
+    void onTimeout();
+
+private:
+    void sendRound();
+
+    const int depth;
+    const qint64 minTime;
+
+    QEventLoop loop;
+    QElapsedTimer timer;
+    qint64 m_calls;
+    qint64 m_rounds;
+    qint64 m_elapsed;
+    qint64 lastProgress;
+    int outstanding;
+    bool failed;
+};
+
+#endif // QTJSONRPC_TRANSPORTBENCHMARKS_H
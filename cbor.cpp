@@ -0,0 +1,605 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "cbor.h"
+#include "rawvalue.h"
+
+#include <QVariantMap>
+#include <QVariantList>
+#include <QStringList>
+#include <QtEndian>
+#include <qnumeric.h>
+
+#include <string.h>
+
+using namespace JsonRPC;
+
+namespace {
+
+enum MajorType
+{
+    UNSIGNED_INTEGER = 0,
+    NEGATIVE_INTEGER = 1,
+    BYTE_STRING      = 2,
+    TEXT_STRING      = 3,
+    ARRAY            = 4,
+    MAP              = 5,
+    TAG              = 6,
+    SIMPLE           = 7
+};
+
+enum SimpleValue
+{
+    FALSE_VALUE     = 20,
+    TRUE_VALUE      = 21,
+    NULL_VALUE      = 22,
+    UNDEFINED_VALUE = 23,
+    HALF_FLOAT      = 25,
+    SINGLE_FLOAT    = 26,
+    DOUBLE_FLOAT    = 27
+};
+
+// protects the stack against maliciously nested messages
+const int MAX_DEPTH = 512;
+
+inline void writeHeader(QByteArray &out, MajorType type, quint64 value)
+{
+    const char major = char(type << 5);
+
+    if (value < 24) {
+        out.append(char(major | value));
+    } else if (value <= 0xff) {
+        out.append(char(major | 24));
+        out.append(char(value));
+    } else if (value <= 0xffff) {
+        uchar buffer[3];
+        buffer[0] = major | 25;
+        qToBigEndian<quint16>(value, buffer + 1);
+        out.append(reinterpret_cast<const char *>(buffer), 3);
+    } else if (value <= Q_UINT64_C(0xffffffff)) {
+        uchar buffer[5];
+        buffer[0] = major | 26;
+        qToBigEndian<quint32>(value, buffer + 1);
+        out.append(reinterpret_cast<const char *>(buffer), 5);
+    } else {
+        uchar buffer[9];
+        buffer[0] = major | 27;
+        qToBigEndian<quint64>(value, buffer + 1);
+        out.append(reinterpret_cast<const char *>(buffer), 9);
+    }
+}
+
+inline void writeInteger(QByteArray &out, qint64 value)
+{
+    if (value >= 0)
+        writeHeader(out, UNSIGNED_INTEGER, value);
+    else
+        writeHeader(out, NEGATIVE_INTEGER, quint64(-1 - value));
+}
+
+inline void writeString(QByteArray &out, const QString &string)
+{
+    const QByteArray utf8 = string.toUtf8();
+    writeHeader(out, TEXT_STRING, utf8.size());
+    out.append(utf8);
+}
+
+void writeDouble(QByteArray &out, double value)
+{
+    const float single = float(value);
+
+    // NaN is the only value that isn't equal to itself
+    if (double(single) == value || value != value) {
+        quint32 bits;
+        memcpy(&bits, &single, sizeof(bits));
+
+        uchar buffer[5];
+        buffer[0] = (SIMPLE << 5) | SINGLE_FLOAT;
+        qToBigEndian<quint32>(bits, buffer + 1);
+        out.append(reinterpret_cast<const char *>(buffer), 5);
+    } else {
+        quint64 bits;
+        memcpy(&bits, &value, sizeof(bits));
+
+        uchar buffer[9];
+        buffer[0] = (SIMPLE << 5) | DOUBLE_FLOAT;
+        qToBigEndian<quint64>(bits, buffer + 1);
+        out.append(reinterpret_cast<const char *>(buffer), 9);
+    }
+}
+
+// exact is set to false when a value has no CBOR representation
+void writeValue(QByteArray &out, const QVariant &value, bool &exact)
+{
+    switch (value.type()) {
+    case QVariant::Invalid:
+        out.append(char((SIMPLE << 5) | NULL_VALUE));
+        break;
+    case QVariant::Bool:
+        out.append(char((SIMPLE << 5)
+                        | (value.toBool() ? TRUE_VALUE : FALSE_VALUE)));
+        break;
+    case QVariant::Int:
+    case QVariant::LongLong:
+        writeInteger(out, value.toLongLong());
+        break;
+    case QVariant::UInt:
+    case QVariant::ULongLong:
+        writeHeader(out, UNSIGNED_INTEGER, value.toULongLong());
+        break;
+    case QVariant::Double:
+        writeDouble(out, value.toDouble());
+        break;
+    case QVariant::ByteArray:
+    {
+        const QByteArray bytes = value.toByteArray();
+        writeHeader(out, BYTE_STRING, bytes.size());
+        out.append(bytes);
+        break;
+    }
+    case QVariant::Map:
+    {
+        const QVariantMap map = value.toMap();
+        writeHeader(out, MAP, map.size());
+        for (QVariantMap::const_iterator i = map.constBegin();
+             i != map.constEnd();++i) {
+            writeString(out, i.key());
+            writeValue(out, i.value(), exact);
+        }
+        break;
+    }
+    case QVariant::List:
+    {
+        const QVariantList list = value.toList();
+        writeHeader(out, ARRAY, list.size());
+        Q_FOREACH (const QVariant &element, list)
+            writeValue(out, element, exact);
+        break;
+    }
+    case QVariant::StringList:
+    {
+        const QStringList list = value.toStringList();
+        writeHeader(out, ARRAY, list.size());
+        Q_FOREACH (const QString &element, list)
+            writeString(out, element);
+        break;
+    }
+    default:
+        // the other types are sent as strings, like in the JSON encoding
+        exact = false;
+        if (value.isNull() || !value.canConvert(QVariant::String))
+            out.append(char((SIMPLE << 5) | NULL_VALUE));
+        else
+            writeString(out, value.toString());
+    }
+}
+
+class Reader
+{
+public:
+    Reader(const char *begin, const char *end, int options = 0) :
+        pos(reinterpret_cast<const uchar *>(begin)),
+        end(reinterpret_cast<const uchar *>(end)),
+        depth(0),
+        options(options),
+        rootIsArray(false)
+    {
+    }
+
+    bool readDocument(QVariant &value)
+    {
+        rootIsArray = pos != end && (*pos >> 5) == ARRAY;
+        return readValue(value) && pos == end;
+    }
+
+    bool readMember(const QString &key, QVariant &value)
+    {
+        int type;
+        int info;
+        quint64 size;
+
+        if (!readHeader(type, info, size) || type != MAP)
+            return false;
+
+        for (quint64 i = 0;i != size;++i) {
+            QVariant name;
+            if (!readValue(name))
+                return false;
+
+            // the last occurrence wins, like in readMap
+            if (name.toString() == key) {
+                if (!readValue(value))
+                    return false;
+            } else if (!skipValue()) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool readElement(int index, QVariant &value)
+    {
+        int type;
+        int info;
+        quint64 size;
+
+        if (!readHeader(type, info, size) || type != ARRAY)
+            return false;
+
+        for (quint64 i = 0;i != size;++i) {
+            if (i == quint64(index))
+                return readValue(value);
+
+            if (!skipValue())
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    bool readHeader(int &type, int &info, quint64 &argument)
+    {
+        if (pos == end)
+            return false;
+
+        type = *pos >> 5;
+        info = *pos & 0x1f;
+        ++pos;
+
+        if (info < 24) {
+            argument = info;
+            return true;
+        }
+
+        int size;
+        switch (info) {
+        case 24:
+            size = 1;
+            break;
+        case 25:
+            size = 2;
+            break;
+        case 26:
+            size = 4;
+            break;
+        case 27:
+            size = 8;
+            break;
+        default:
+            // indefinite lengths and reserved values
+            return false;
+        }
+
+        if (end - pos < size)
+            return false;
+
+        switch (size) {
+        case 1:
+            argument = *pos;
+            break;
+        case 2:
+            argument = qFromBigEndian<quint16>(pos);
+            break;
+        case 4:
+            argument = qFromBigEndian<quint32>(pos);
+            break;
+        default:
+            argument = qFromBigEndian<quint64>(pos);
+        }
+
+        pos += size;
+        return true;
+    }
+
+    bool readString(quint64 size, QByteArray *bytes, QString *string)
+    {
+        if (quint64(end - pos) < size)
+            return false;
+
+        const char *data = reinterpret_cast<const char *>(pos);
+        if (bytes)
+            *bytes = QByteArray(data, size);
+        else
+            *string = QString::fromUtf8(data, size);
+
+        pos += size;
+        return true;
+    }
+
+    bool readValue(QVariant &value)
+    {
+        int type;
+        int info;
+        quint64 argument;
+
+        if (!readTaggedHeader(type, info, argument))
+            return false;
+
+        switch (type) {
+        case UNSIGNED_INTEGER:
+            if (argument <= Q_UINT64_C(0x7fffffff))
+                value = int(argument);
+            else if (argument <= Q_UINT64_C(0x7fffffffffffffff))
+                value = qlonglong(argument);
+            else
+                value = qulonglong(argument);
+            return true;
+        case NEGATIVE_INTEGER:
+            // the value is -1 - argument
+            if (argument <= Q_UINT64_C(0x7fffffff))
+                value = int(-1 - qint64(argument));
+            else if (argument <= Q_UINT64_C(0x7fffffffffffffff))
+                value = qlonglong(-1 - qint64(argument));
+            else
+                value = -1.0 - double(argument);
+            return true;
+        case BYTE_STRING:
+        {
+            QByteArray bytes;
+            if (!readString(argument, &bytes, NULL))
+                return false;
+            value = bytes;
+            return true;
+        }
+        case TEXT_STRING:
+        {
+            QString string;
+            if (!readString(argument, NULL, &string))
+                return false;
+            value = string;
+            return true;
+        }
+        case ARRAY:
+            return readArray(argument, value);
+        case MAP:
+            return readMap(argument, value);
+        default:
+            return readSimple(info, argument, value);
+        }
+    }
+
+    bool readArray(quint64 size, QVariant &value)
+    {
+        // each element takes at least one byte
+        if (++depth > MAX_DEPTH || quint64(end - pos) < size)
+            return false;
+
+        QVariantList array;
+        array.reserve(size);
+
+        for (quint64 i = 0;i != size;++i) {
+            QVariant element;
+            if (!readValue(element))
+                return false;
+            array.push_back(element);
+        }
+
+        --depth;
+        value = array;
+        return true;
+    }
+
+    // tags are ignored, only the header of the tagged item is returned.
+    // They're consumed in a loop, a message made only of tags would
+    // exhaust the stack if each one was read by a recursive call.
+    bool readTaggedHeader(int &type, int &info, quint64 &argument)
+    {
+        do {
+            if (!readHeader(type, info, argument))
+                return false;
+        } while (type == TAG);
+
+        return true;
+    }
+
+    // validates a data item without decoding it
+    bool skipValue()
+    {
+        int type;
+        int info;
+        quint64 argument;
+
+        if (!readTaggedHeader(type, info, argument))
+            return false;
+
+        switch (type) {
+        case BYTE_STRING:
+        case TEXT_STRING:
+            if (quint64(end - pos) < argument)
+                return false;
+            pos += argument;
+            return true;
+        case ARRAY:
+        case MAP:
+        {
+            // each element takes at least one byte
+            if (++depth > MAX_DEPTH || quint64(end - pos) < argument)
+                return false;
+
+            const quint64 items = (type == MAP) ? argument * 2 : argument;
+            for (quint64 i = 0;i != items;++i) {
+                if (!skipValue())
+                    return false;
+            }
+
+            --depth;
+            return true;
+        }
+        default:
+            // the argument of numbers and simple values was already read
+            return true;
+        }
+    }
+
+    bool readMap(quint64 size, QVariant &value)
+    {
+        // each pair takes at least two bytes
+        if (++depth > MAX_DEPTH || quint64(end - pos) / 2 < size)
+            return false;
+
+        // the params of a request or of a request in a batch
+        const bool rawParams = (options & Cbor::RAW_PARAMS)
+                && (depth == 1 || (depth == 2 && rootIsArray));
+
+        QVariantMap map;
+
+        for (quint64 i = 0;i != size;++i) {
+            QVariant key;
+            if (!readValue(key))
+                return false;
+
+            // JSON objects only have string keys
+            if (key.type() != QVariant::String
+                    && key.type() != QVariant::Int
+                    && key.type() != QVariant::LongLong
+                    && key.type() != QVariant::ULongLong)
+                return false;
+
+            QVariant element;
+            if (rawParams && key.type() == QVariant::String
+                    && key.toString() == QLatin1String("params")) {
+                const uchar *begin = pos;
+                if (!skipValue())
+                    return false;
+                const char *data = reinterpret_cast<const char *>(begin);
+                element = QVariant::fromValue(RawValue(QByteArray(data, pos - begin),
+                                                       RawValue::CBOR_FORMAT));
+            } else if (!readValue(element)) {
+                return false;
+            }
+            map.insert(key.toString(), element);
+        }
+
+        --depth;
+        value = map;
+        return true;
+    }
+
+    bool readSimple(int info, quint64 argument, QVariant &value)
+    {
+        switch (info) {
+        case FALSE_VALUE:
+            value = false;
+            return true;
+        case TRUE_VALUE:
+            value = true;
+            return true;
+        case HALF_FLOAT:
+            value = halfToDouble(argument);
+            return true;
+        case SINGLE_FLOAT:
+        {
+            const quint32 bits = argument;
+            float single;
+            memcpy(&single, &bits, sizeof(single));
+            value = double(single);
+            return true;
+        }
+        case DOUBLE_FLOAT:
+        {
+            double number;
+            memcpy(&number, &argument, sizeof(number));
+            value = number;
+            return true;
+        }
+        default:
+            // null, undefined and unassigned simple values
+            value = QVariant();
+            return true;
+        }
+    }
+
+    static double halfToDouble(quint64 half)
+    {
+        const int exponent = (half >> 10) & 0x1f;
+        const int mantissa = half & 0x3ff;
+        double number;
+
+        if (exponent == 0)
+            number = mantissa * (1.0 / (1 << 24));
+        else if (exponent != 31)
+            number = (mantissa + 1024) * double(1 << exponent) / (1 << 25);
+        else if (mantissa == 0)
+            number = qInf();
+        else
+            number = qQNaN();
+
+        return (half & 0x8000) ? -number : number;
+    }
+
+    const uchar *pos;
+    const uchar *const end;
+    int depth;
+    const int options;
+    bool rootIsArray;
+};
+
+} // namespace
+
+QByteArray Cbor::serialize(const QVariant &value)
+{
+    bool exact;
+    return serialize(value, exact);
+}
+
+QByteArray Cbor::serialize(const QVariant &value, bool &exact)
+{
+    QByteArray out;
+    exact = true;
+    writeValue(out, value, exact);
+    return out;
+}
+
+void Cbor::serialize(QByteArray &out, const QVariant &value)
+{
+    bool exact;
+    writeValue(out, value, exact);
+}
+
+void Cbor::serializeArrayHeader(QByteArray &out, int size)
+{
+    writeHeader(out, ARRAY, size);
+}
+
+QVariant Cbor::parse(const QByteArray &cbor, bool &ok, int options)
+{
+    return parse(cbor.constData(), cbor.size(), ok, options);
+}
+
+QVariant Cbor::parse(const char *cbor, int size, bool &ok, int options)
+{
+    QVariant value;
+    Reader reader(cbor, cbor + size, options);
+
+    ok = reader.readDocument(value);
+    if (!ok)
+        return QVariant();
+
+    return value;
+}
+
+QVariant Cbor::parseMember(const char *cbor, int size, const QString &key,
+                           bool &ok)
+{
+    QVariant value;
+    Reader reader(cbor, cbor + size);
+
+    ok = reader.readMember(key, value);
+    if (!ok)
+        return QVariant();
+
+    return value;
+}
+
+QVariant Cbor::parseElement(const char *cbor, int size, int index, bool &ok)
+{
+    QVariant value;
+    Reader reader(cbor, cbor + size);
+
+    ok = reader.readElement(index, value);
+    if (!ok)
+        return QVariant();
+
+    return value;
+}
@@ -0,0 +1,94 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_CBOR_H
+#define QTJSONRPC_CBOR_H
+
+#include <QVariant>
+#include <QByteArray>
+
+namespace JsonRPC {
+
+/*!
+  Binary encoding (CBOR, RFC 7049) of the JSON object model.
+  The QVariant trees are encoded directly, with no text formatting or
+  number parsing. It's used by Peer when the CBOR_ENCODING is selected.
+
+  Encoding:
+  - QVariantMap: map with text string keys
+  - QVariantList and QStringList: array
+  - QString: text string
+  - QByteArray: byte string
+  - bool and null: simple values
+  - integers: unsigned or negative integers
+  - double: single precision float, if no precision is lost, otherwise
+    double precision float
+
+  Decoding generates the same types used by JsonParser. Indefinite length
+  items are not supported and tags are ignored.
+  */
+class Cbor
+{
+public:
+    enum Option
+    {
+        NO_OPTIONS = 0x0,
+        /*! The "params" member of the top-level map, or of the maps in
+          a top-level array, is validated but not decoded. It's stored as
+          a RawValue, that can be decoded later.
+          @sa JsonParser::RAW_PARAMS
+          */
+        RAW_PARAMS = 0x1
+    };
+
+    /*!
+      @return \param value encoded as CBOR.
+      */
+    static QByteArray serialize(const QVariant &value);
+    /*!
+      Like serialize, but \param exact is set to false if a value of a
+      type without a CBOR representation was encoded as a string or null,
+      so distinct values can have the same encoding.
+      */
+    static QByteArray serialize(const QVariant &value, bool &exact);
+    /*!
+      Appends \param value encoded as CBOR to \param out.
+      */
+    static void serialize(QByteArray &out, const QVariant &value);
+    /*!
+      Appends the header of an array of \param size elements to \param out.
+      The encoded elements must be appended right after it.
+      */
+    static void serializeArrayHeader(QByteArray &out, int size);
+
+    /*!
+      Decodes \param cbor, that must contain a single CBOR data item.
+      \param ok is set to true if \param cbor is valid.
+      \param options is a combination of the Option flags.
+      @return the decoded value, or a null QVariant if \param ok is false.
+      */
+    static QVariant parse(const QByteArray &cbor, bool &ok,
+                          int options = NO_OPTIONS);
+    /*!
+      Decodes the \param size bytes starting at \param cbor.
+      @sa parse
+      */
+    static QVariant parse(const char *cbor, int size, bool &ok,
+                          int options = NO_OPTIONS);
+
+    /*!
+      Decodes only the member \param key of the map in \param cbor.
+      @sa JsonParser::parseMember
+      */
+    static QVariant parseMember(const char *cbor, int size,
+                                const QString &key, bool &ok);
+    /*!
+      Decodes only the element \param index of the array in \param cbor.
+      @sa JsonParser::parseElement
+      */
+    static QVariant parseElement(const char *cbor, int size, int index,
+                                 bool &ok);
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_CBOR_H
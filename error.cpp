@@ -5,8 +5,7 @@
   */
 
 #include "responsehandler.h"
-
-#include <qt-json/json.h>
+#include "responsewriter.h"
 
 JsonRPC::Error::Error(ErrorCode code) :
     code(code)
@@ -25,6 +24,8 @@ JsonRPC::Error::Error(ErrorCode code) :
         desc = "Invalid method parameter(s).";
         break;
     case INTERNAL_ERROR:
+        desc = "Internal error.";
+        break;
     default:
         this->code = NO_ERROR;
     case NO_ERROR:
@@ -40,7 +41,7 @@ JsonRPC::Error::Error(ErrorCode code, QString desc) :
 
 JsonRPC::Error::operator QByteArray() const
 {
-    return QtJson::Json::serialize(static_cast<QVariantMap>(*this));
+    return ResponseWriter::error(*this, QVariant(), Peer::JSON_ENCODING);
 }
 
 JsonRPC::Error::operator QVariantMap() const
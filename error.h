@@ -33,7 +33,8 @@ struct Error
     Error(ErrorCode code = NO_ERROR);
     Error(const Error &);
 
-    /*! Generates the JSON object.
+    /*! Generates the JSON error response, with a null id.
+      The standard errors are serialized only once.
       */
     operator QByteArray() const;
     /*! Generates the QVariantMap object.
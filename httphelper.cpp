@@ -3,16 +3,29 @@
 #include "httphelper.h"
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
+#include <QTimer>
 
-#include <qt-json/json.h>
+#include "error.h"
+#include "jsonparser.h"
 
 using namespace JsonRPC;
 
 HttpHelper::HttpHelper(QObject *parent) :
     QObject(parent),
     peer(new Peer(this)),
-    httpClient(new QNetworkAccessManager(this))
+    httpClient(new QNetworkAccessManager(this)),
+    m_batching(false),
+    m_maxBatchSize(100),
+    batchTimer(new QTimer(this)),
+    m_maxConcurrentRequests(6),
+    m_maxQueuedRequests(0),
+    m_pipelining(false),
+    activeRequests(0)
 {
+    batchTimer->setSingleShot(true);
+    batchTimer->setInterval(0);
+    connect(batchTimer, SIGNAL(timeout()), this, SLOT(flushBatch()));
+
     connect(peer, SIGNAL(readyRequestMessage(QByteArray)),
             this, SLOT(onReadyRequestMessage(QByteArray)));
     connect(peer, SIGNAL(readyResponse(QVariant,QVariant)),
@@ -36,33 +49,265 @@ void HttpHelper::setUrl(const QUrl &url)
 
 bool HttpHelper::call(const QString &method, const QVariant &params, const QVariant &id)
 {
+    if (isQueueFull())
+        return false;
+
     return peer->call(method, params, id);
 }
 
+QVariant HttpHelper::call(const QString &method, const QVariant &params,
+                          QObject *receiver, const char *returnMethod,
+                          const char *errorMethod)
+{
+    if (isQueueFull())
+        return QVariant();
+
+    return peer->call(method, params, receiver, returnMethod, errorMethod);
+}
+
+bool HttpHelper::notify(const QString &method, const QVariant &params)
+{
+    if (isQueueFull())
+        return false;
+
+    return peer->notify(method, params);
+}
+
+int HttpHelper::pendingCallCount() const
+{
+    return peer->pendingCallCount();
+}
+
+bool HttpHelper::callCoalescing() const
+{
+    return peer->callCoalescing();
+}
+
+void HttpHelper::setCallCoalescing(bool enabled)
+{
+    peer->setCallCoalescing(enabled);
+}
+
+bool HttpHelper::batching() const
+{
+    return m_batching;
+}
+
+void HttpHelper::setBatching(bool enabled)
+{
+    m_batching = enabled;
+
+    if (!enabled)
+        flushBatch();
+}
+
+int HttpHelper::batchWindow() const
+{
+    return batchTimer->interval();
+}
+
+void HttpHelper::setBatchWindow(int msecs)
+{
+    batchTimer->setInterval(qMax(0, msecs));
+}
+
+int HttpHelper::maxBatchSize() const
+{
+    return m_maxBatchSize;
+}
+
+void HttpHelper::setMaxBatchSize(int size)
+{
+    m_maxBatchSize = qMax(1, size);
+}
+
+int HttpHelper::maxConcurrentRequests() const
+{
+    return m_maxConcurrentRequests;
+}
+
+void HttpHelper::setMaxConcurrentRequests(int max)
+{
+    m_maxConcurrentRequests = qMax(0, max);
+    sendQueued();
+}
+
+int HttpHelper::maxQueuedRequests() const
+{
+    return m_maxQueuedRequests;
+}
+
+void HttpHelper::setMaxQueuedRequests(int max)
+{
+    m_maxQueuedRequests = qMax(0, max);
+}
+
+int HttpHelper::queuedRequestCount() const
+{
+    return queue.size();
+}
+
+bool HttpHelper::pipelining() const
+{
+    return m_pipelining;
+}
+
+void HttpHelper::setPipelining(bool enabled)
+{
+    m_pipelining = enabled;
+}
+
+bool HttpHelper::isQueueFull() const
+{
+    return m_maxQueuedRequests && queue.size() >= m_maxQueuedRequests;
+}
+
 void HttpHelper::onReadyRequestMessage(const QByteArray &json)
+{
+    if (!m_batching) {
+        post(json);
+        return;
+    }
+
+    batch.push_back(json);
+
+    if (batch.size() >= m_maxBatchSize)
+        flushBatch();
+    else if (!batchTimer->isActive())
+        batchTimer->start();
+}
+
+void HttpHelper::flushBatch()
+{
+    batchTimer->stop();
+
+    if (batch.isEmpty())
+        return;
+
+    if (batch.size() == 1) {
+        post(batch.first());
+        batch.clear();
+        return;
+    }
+
+    // the messages are already serialized, so the batch array is built
+    // by joining them
+    int size = batch.size() + 1;
+    Q_FOREACH (const QByteArray &json, batch)
+        size += json.size();
+
+    QByteArray json;
+    json.reserve(size);
+    json.append('[');
+    for (int i = 0;i != batch.size();++i) {
+        if (i)
+            json.append(',');
+        json.append(batch[i]);
+    }
+    json.append(']');
+
+    batch.clear();
+    post(json);
+}
+
+void HttpHelper::post(const QByteArray &json)
+{
+    if (m_maxConcurrentRequests && activeRequests >= m_maxConcurrentRequests) {
+        queue.push_back(json);
+        return;
+    }
+
+    send(json);
+}
+
+// sends the queued messages while there are free request slots
+void HttpHelper::sendQueued()
+{
+    while (!queue.isEmpty() && (!m_maxConcurrentRequests
+                                || activeRequests < m_maxConcurrentRequests))
+        send(queue.takeFirst());
+}
+
+void HttpHelper::send(const QByteArray &json)
 {
     QNetworkRequest request(m_url);
     request.setHeader(QNetworkRequest::ContentTypeHeader,
                       QString("application/json-rpc"));
     request.setRawHeader("Accept", "application/json-rpc");
+    // asks HTTP/1.0 servers to keep the connection open too
+    request.setRawHeader("Connection", "keep-alive");
 
-    httpClient->post(request, json);
+    if (m_pipelining)
+        request.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute,
+                             true);
+
+    ++activeRequests;
+    sent.insert(httpClient->post(request, json), json);
+}
+
+// answers the pending calls of request that its reply didn't answer
+void HttpHelper::failPendingCalls(const QByteArray &request,
+                                  const QString &reason,
+                                  QNetworkReply::NetworkError code)
+{
+    if (!peer->pendingCallCount())
+        return;
+
+    // only the ids are needed, the params aren't decoded
+    bool ok;
+    const QVariant json = JsonParser::parse(request, ok,
+                                            JsonParser::RAW_PARAMS);
+    if (!ok)
+        return;
+
+    QVariantList objects;
+    if (json.type() == QVariant::List)
+        objects = json.toList();
+    else
+        objects.push_back(json);
+
+    Q_FOREACH (const QVariant &object, objects) {
+        const QVariantMap map = object.toMap();
+        const QVariantMap::const_iterator id = map.constFind("id");
+        if (id != map.constEnd())
+            peer->failPendingCall(id.value(), INTERNAL_ERROR, reason,
+                                  int(code));
+    }
 }
 
 void HttpHelper::replyFinished(QNetworkReply *reply)
 {
     reply->deleteLater();
-    QByteArray content = reply->readAll();
+    --activeRequests;
+    const QByteArray request = sent.take(reply);
 
-    if (reply->error() != QNetworkReply::NoError) {
-        bool ok;
-        QtJson::Json::parse(QString::fromUtf8(content), ok);
+    // the slot is used by the next message before this one is handled
+    sendQueued();
 
-        if (!ok) {
-            emit error(reply->error());
-            return;
-        }
-    }
+    const QByteArray content = reply->readAll();
+    const QNetworkReply::NetworkError code = reply->error();
+
+    // the body is parsed only once: a JSON-RPC error response is
+    // delivered even with a HTTP error status, and a reply without a
+    // valid body is reported as a network error
+    bool ok = false;
+    QVariant json;
+    if (!content.isEmpty())
+        json = JsonParser::parse(content, ok);
+
+    if (ok)
+        peer->handleResponse(json);
+
+    // The calls of this request that are still pending will never be
+    // answered: the request failed, the body isn't JSON, or the server
+    // answered with an error of null id or with a partial batch.
+    // Notifications are answered with an empty body and aren't pending.
+    if (code != QNetworkReply::NoError)
+        failPendingCalls(request, reply->errorString(), code);
+    else
+        failPendingCalls(request, "The call wasn't answered by the server.",
+                         code);
 
-    peer->handleMessage(content);
+    if (!ok && code != QNetworkReply::NoError)
+        emit error(code);
 }
@@ -8,6 +8,7 @@
 #include <QNetworkReply>
 
 class QNetworkAccessManager;
+class QTimer;
 
 namespace JsonRPC {
 
@@ -26,6 +27,99 @@ public:
       */
     void setUrl(const QUrl &url);
 
+    /*!
+      @return the number of calls made with a completion callback that
+      are still waiting for a response.
+      @sa Peer::pendingCallCount
+      */
+    int pendingCallCount() const;
+
+    /*!
+      @return true if identical calls are coalesced.
+      */
+    bool callCoalescing() const;
+    /*!
+      Sets whether a call identical to a pending one waits for its
+      response instead of being sent. The default is false.
+      @sa Peer::setCallCoalescing
+      */
+    void setCallCoalescing(bool enabled);
+
+    /*!
+      @return true if the calls are sent in batches.
+      @sa setBatching
+      */
+    bool batching() const;
+    /*! Sets whether the calls are sent in batches.
+      When enabled, the calls made within the batch window are sent as a
+      single JSON-RPC batch, in one POST request. The responses of the
+      batch are delivered through the same signals used for single calls.
+      Batching is disabled by default.
+      @sa setBatchWindow setMaxBatchSize
+      */
+    void setBatching(bool enabled);
+
+    /*!
+      @return the time, in milliseconds, that a call waits for other
+      calls before the batch is sent.
+      */
+    int batchWindow() const;
+    /*! Sets the time, in milliseconds, that a call waits for other calls
+      before the batch is sent.
+      The default is 0, so the calls made in the same event loop iteration
+      are sent together.
+      */
+    void setBatchWindow(int msecs);
+
+    /*!
+      @return the maximum number of calls in a batch.
+      */
+    int maxBatchSize() const;
+    /*! Sets the maximum number of calls in a batch. A batch is sent as
+      soon as it reaches this size, without waiting for the batch window.
+      The default is 100.
+      */
+    void setMaxBatchSize(int size);
+
+    /*!
+      @return the maximum number of POST requests in flight.
+      */
+    int maxConcurrentRequests() const;
+    /*! Sets the maximum number of POST requests in flight to \param max.
+      The other requests wait in a queue and are sent, in order, as the
+      responses arrive. 0 means no limit.
+      The default is 6, the number of connections that
+      QNetworkAccessManager opens to a host, so a burst of calls reuses
+      the open connections instead of waiting for new ones.
+      */
+    void setMaxConcurrentRequests(int max);
+
+    /*!
+      @return the maximum number of POST requests waiting in the queue.
+      */
+    int maxQueuedRequests() const;
+    /*! Sets the maximum number of POST requests waiting in the queue to
+      \param max. While the queue is full, call fails. 0 means no limit
+      (the default).
+      @sa setMaxConcurrentRequests
+      */
+    void setMaxQueuedRequests(int max);
+    /*!
+      @return the number of POST requests waiting in the queue.
+      */
+    int queuedRequestCount() const;
+
+    /*!
+      @return true if HTTP pipelining is allowed.
+      */
+    bool pipelining() const;
+    /*! Sets whether the POST requests can be pipelined in the persistent
+      connections (QNetworkRequest::HttpPipeliningAllowedAttribute).
+      The server must support it, as HttpServer does.
+      The default is false.
+      */
+    void setPipelining(bool enabled);
+
 signals:
     /*!
       Emitted when the result for your call is available.
@@ -50,19 +144,63 @@ public slots:
     /*!
       Prepares a request message.
       @return true if \param method, \param params and \param id are valid,
-      according JSON-RPC 2.0 spec.
+      according JSON-RPC 2.0 spec, and the queue isn't full.
       */
     bool call(const QString &method, const QVariant &params, const QVariant &id);
+    /*!
+      Prepares a request message using an id generated by the peer and
+      delivers its response only to \param receiver.
+      If the reply to the POST request doesn't answer the call (the
+      request failed, the body isn't a JSON-RPC response, or it's an
+      error with a null id or a batch without this call), the call, and
+      the calls coalesced with it, get an INTERNAL_ERROR. Its message is
+      the description of the failure and its data the
+      QNetworkReply::NetworkError code.
+      @return the generated id, or a null QVariant on failure.
+      @sa Peer::call
+      */
+    QVariant call(const QString &method, const QVariant &params,
+                  QObject *receiver, const char *returnMethod,
+                  const char *errorMethod = 0);
+    /*!
+      Prepares a notification message, that is never answered.
+      @return true if \param method and \param params are valid,
+      according JSON-RPC 2.0 spec.
+      @sa Peer::notify
+      */
+    bool notify(const QString &method, const QVariant &params);
 
 private slots:
     void onReadyRequestMessage(const QByteArray &json);
     void replyFinished(QNetworkReply *reply);
+    void flushBatch();
 
 private:
+    void post(const QByteArray &json);
+    void send(const QByteArray &json);
+    void sendQueued();
+    void failPendingCalls(const QByteArray &request, const QString &reason,
+                          QNetworkReply::NetworkError code);
+    bool isQueueFull() const;
+
     Peer *peer;
 
     QNetworkAccessManager *httpClient;
     QUrl m_url;
+
+    bool m_batching;
+    int m_maxBatchSize;
+    QTimer *batchTimer;
+    QList<QByteArray> batch;
+
+    int m_maxConcurrentRequests;
+    int m_maxQueuedRequests;
+    bool m_pipelining;
+    int activeRequests;
+    // messages waiting for a free request slot
+    QList<QByteArray> queue;
+    // the message of each request in flight
+    QHash<QNetworkReply *, QByteArray> sent;
 };
 
 } // namespace JsonRPC
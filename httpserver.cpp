@@ -0,0 +1,672 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "httpserver.h"
+#include "httpserver_p.h"
+#include "responsehandler.h"
+
+#include <QThread>
+#include <QTcpSocket>
+#include <QTimer>
+
+using namespace JsonRPC;
+
+HttpServerWorker::HttpServerWorker(HttpServer *server) :
+    server(server),
+    thread(new QThread)
+{
+    moveToThread(thread);
+    thread->start();
+}
+
+HttpServerWorker::~HttpServerWorker()
+{
+    // the connections were created in the worker thread, so their
+    // sockets and timers must be destroyed there
+    QMetaObject::invokeMethod(this, "closeConnections",
+                              Qt::BlockingQueuedConnection);
+
+    thread->quit();
+    thread->wait();
+    delete thread;
+}
+
+void HttpServerWorker::addConnection(int socketDescriptor,
+                                     int keepAliveTimeout,
+                                     int maxRequestSize,
+                                     int maxInFlightRequests,
+                                     qlonglong maxBufferedBytes)
+{
+    QTcpSocket *socket = new QTcpSocket;
+
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        delete socket;
+        connections.deref();
+        return;
+    }
+
+    HttpConnection *connection
+            = new HttpConnection(socket, server, keepAliveTimeout,
+                                 maxRequestSize, maxInFlightRequests,
+                                 maxBufferedBytes, this);
+    connect(connection, SIGNAL(closed()), this, SLOT(onClosed()));
+    // delivered to the thread of the server
+    connect(connection,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)),
+            server,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+}
+
+void HttpServerWorker::onClosed()
+{
+    sender()->deleteLater();
+    connections.deref();
+}
+
+void HttpServerWorker::closeConnections()
+{
+    // children() changes while the objects are deleted
+    const QObjectList objects = children();
+    qDeleteAll(objects);
+}
+
+HttpConnection::HttpConnection(QTcpSocket *socket, HttpServer *server,
+                               int keepAliveTimeout, int maxRequestSize,
+                               int maxInFlightRequests,
+                               qint64 maxBufferedBytes, QObject *parent) :
+    QObject(parent),
+    socket(socket),
+    server(server),
+    keepAliveTimeout(keepAliveTimeout),
+    maxRequestSize(maxRequestSize),
+    maxInFlightRequests(maxInFlightRequests),
+    maxBufferedBytes(maxBufferedBytes),
+    idleTimer(new QTimer(this)),
+    bufferOffset(0),
+    continueSent(false),
+    closing(false),
+    stalled(false)
+{
+    socket->setParent(this);
+
+    idleTimer->setSingleShot(true);
+    connect(idleTimer, SIGNAL(timeout()), this, SLOT(onTimeout()));
+
+    connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    connect(socket, SIGNAL(bytesWritten(qint64)),
+            this, SLOT(resumeReading()));
+
+    if (keepAliveTimeout > 0)
+        idleTimer->start(keepAliveTimeout);
+}
+
+void HttpConnection::onReadyRead()
+{
+    if (stalled)
+        return;
+
+    if (closing) {
+        socket->readAll();
+        return;
+    }
+
+    // the connection isn't idle while a request is being received
+    if (keepAliveTimeout > 0)
+        idleTimer->start(keepAliveTimeout);
+
+    // the handled bytes are removed only when they are at least half of
+    // the buffer, as in TcpHelper
+    if (bufferOffset && bufferOffset >= buffer.size() - bufferOffset) {
+        buffer.remove(0, bufferOffset);
+        bufferOffset = 0;
+    }
+
+    buffer.append(socket->readAll());
+
+    while (!closing) {
+        if (overLimits()) {
+            // a read buffer of 0 bytes means unlimited
+            stalled = true;
+            socket->setReadBufferSize(1);
+            break;
+        }
+
+        QByteArray body;
+        bool post;
+        bool keepAlive;
+        bool http10;
+        const ParseResult result = parseRequest(body, post, keepAlive, http10);
+
+        if (result == INCOMPLETE)
+            break;
+
+        if (result == BAD_REQUEST) {
+            fail("400 Bad Request");
+            break;
+        }
+
+        if (result == TOO_LARGE) {
+            fail("413 Request Entity Too Large");
+            break;
+        }
+
+        Exchange exchange;
+        exchange.peer = NULL;
+        exchange.finished = false;
+        exchange.keepAlive = keepAlive;
+        exchange.http10 = http10;
+
+        if (!keepAlive)
+            closing = true;
+
+        if (!post) {
+            exchange.status = "405 Method Not Allowed";
+            exchange.finished = true;
+            exchanges.push_back(exchange);
+            continue;
+        }
+
+        Peer *peer = takePeer();
+        exchange.peer = peer;
+        exchanges.push_back(exchange);
+
+        // body can share the buffer memory, it isn't changed until the
+        // next call to this slot
+        peer->handleMessage(body);
+
+        // notifications and invalid messages are answered (or not)
+        // without changing the count of requests in flight
+        if (!peer->inFlightRequestCount())
+            finishExchange(peer);
+    }
+
+    if (bufferOffset == buffer.size()) {
+        buffer.clear();
+        bufferOffset = 0;
+    }
+
+    writeResponses();
+}
+
+HttpConnection::ParseResult HttpConnection::parseRequest(QByteArray &body,
+                                                         bool &post,
+                                                         bool &keepAlive,
+                                                         bool &http10)
+{
+    // empty lines before a request are ignored
+    while (bufferOffset != buffer.size()
+           && (buffer[bufferOffset] == '\r' || buffer[bufferOffset] == '\n'))
+        ++bufferOffset;
+
+    const int headerEnd = buffer.indexOf("\r\n\r\n", bufferOffset);
+    if (headerEnd == -1) {
+        return buffer.size() - bufferOffset > maxRequestSize
+                ? TOO_LARGE : INCOMPLETE;
+    }
+
+    const QList<QByteArray> lines
+            = buffer.mid(bufferOffset, headerEnd - bufferOffset).split('\n');
+
+    const QList<QByteArray> requestLine = lines.first().simplified().split(' ');
+    if (requestLine.size() != 3)
+        return BAD_REQUEST;
+
+    if (requestLine[2] == "HTTP/1.1") {
+        http10 = false;
+        keepAlive = true;
+    } else if (requestLine[2] == "HTTP/1.0") {
+        http10 = true;
+        keepAlive = false;
+    } else {
+        return BAD_REQUEST;
+    }
+
+    post = requestLine[0] == "POST";
+
+    qint64 contentLength = 0;
+    bool chunked = false;
+    bool expectContinue = false;
+
+    for (int i = 1;i != lines.size();++i) {
+        const QByteArray &line = lines[i];
+        const int colon = line.indexOf(':');
+        if (colon == -1)
+            return BAD_REQUEST;
+
+        const QByteArray name = line.left(colon).trimmed().toLower();
+        const QByteArray value = line.mid(colon + 1).trimmed().toLower();
+
+        if (name == "content-length") {
+            bool ok;
+            contentLength = value.toLongLong(&ok);
+            if (!ok || contentLength < 0)
+                return BAD_REQUEST;
+        } else if (name == "transfer-encoding") {
+            // chunked must be the last coding, and no other is supported
+            if (value != "chunked")
+                return BAD_REQUEST;
+            chunked = true;
+        } else if (name == "connection") {
+            if (value.contains("close"))
+                keepAlive = false;
+            else if (value.contains("keep-alive"))
+                keepAlive = true;
+        } else if (name == "expect") {
+            expectContinue = value == "100-continue";
+        }
+    }
+
+    const int bodyBegin = headerEnd + 4;
+    ParseResult result;
+    int end = 0;
+
+    if (chunked) {
+        result = parseChunkedBody(bodyBegin, body, end);
+    } else if (bodyBegin - bufferOffset + contentLength > maxRequestSize) {
+        result = TOO_LARGE;
+    } else if (buffer.size() - bodyBegin < contentLength) {
+        result = INCOMPLETE;
+    } else {
+        body = QByteArray::fromRawData(buffer.constData() + bodyBegin,
+                                       contentLength);
+        end = bodyBegin + contentLength;
+        result = COMPLETE;
+    }
+
+    if (result == COMPLETE) {
+        bufferOffset = end;
+        continueSent = false;
+    } else if (result == INCOMPLETE && expectContinue && !http10
+               && !continueSent && exchanges.isEmpty()) {
+        // the interim response can't be sent between pipelined responses
+        socket->write("HTTP/1.1 100 Continue\r\n\r\n");
+        continueSent = true;
+    }
+
+    return result;
+}
+
+HttpConnection::ParseResult HttpConnection::parseChunkedBody(int begin,
+                                                             QByteArray &body,
+                                                             int &end) const
+{
+    int pos = begin;
+
+    while (true) {
+        const int lineEnd = buffer.indexOf("\r\n", pos);
+        if (lineEnd == -1) {
+            return buffer.size() - bufferOffset > maxRequestSize
+                    ? TOO_LARGE : INCOMPLETE;
+        }
+
+        QByteArray sizeField = buffer.mid(pos, lineEnd - pos);
+        const int extension = sizeField.indexOf(';');
+        if (extension != -1)
+            sizeField.truncate(extension);
+
+        bool ok;
+        const int size = sizeField.trimmed().toInt(&ok, 16);
+        if (!ok || size < 0)
+            return BAD_REQUEST;
+
+        pos = lineEnd + 2;
+
+        if (!size) {
+            // the trailer fields are ignored
+            while (true) {
+                const int trailerEnd = buffer.indexOf("\r\n", pos);
+                if (trailerEnd == -1) {
+                    return buffer.size() - bufferOffset > maxRequestSize
+                            ? TOO_LARGE : INCOMPLETE;
+                }
+
+                if (trailerEnd == pos) {
+                    end = pos + 2;
+                    return COMPLETE;
+                }
+
+                pos = trailerEnd + 2;
+            }
+        }
+
+        if (qint64(pos) + size - bufferOffset > maxRequestSize)
+            return TOO_LARGE;
+
+        if (qint64(buffer.size()) < qint64(pos) + size + 2)
+            return INCOMPLETE;
+
+        if (buffer[pos + size] != '\r' || buffer[pos + size + 1] != '\n')
+            return BAD_REQUEST;
+
+        // a single chunk is used without copies
+        if (body.isEmpty() && buffer.mid(pos + size + 2, 3) == "0\r\n")
+            body = QByteArray::fromRawData(buffer.constData() + pos, size);
+        else
+            body.append(buffer.constData() + pos, size);
+
+        pos += size + 2;
+    }
+}
+
+void HttpConnection::onDisconnected()
+{
+    idleTimer->stop();
+    emit closed();
+}
+
+void HttpConnection::onResponseMessage(const QByteArray &json)
+{
+    const int i = findExchange(qobject_cast<Peer *>(sender()));
+    if (i != -1)
+        exchanges[i].response = json;
+}
+
+void HttpConnection::onRequestsFinished(int inFlightCount)
+{
+    if (inFlightCount)
+        return;
+
+    finishExchange(qobject_cast<Peer *>(sender()));
+    writeResponses();
+}
+
+void HttpConnection::onReadyRequest(QSharedPointer<ResponseHandler> handler)
+{
+    // checked for each request, so the connections accepted before
+    // readyRequest was connected also forward their requests
+    if (server->forwardsRequests())
+        emit readyRequest(handler);
+    else
+        handler->error(Error(METHOD_NOT_FOUND));
+}
+
+void HttpConnection::onTimeout()
+{
+    if (exchanges.isEmpty())
+        socket->disconnectFromHost();
+}
+
+int HttpConnection::findExchange(Peer *peer) const
+{
+    for (int i = 0;i != exchanges.size();++i) {
+        if (exchanges[i].peer == peer)
+            return i;
+    }
+    return -1;
+}
+
+void HttpConnection::finishExchange(Peer *peer)
+{
+    const int i = findExchange(peer);
+    if (i != -1)
+        exchanges[i].finished = true;
+}
+
+void HttpConnection::writeResponses()
+{
+    // the responses are sent in the order of the requests and written to
+    // the socket at once
+    QByteArray out;
+    bool close = false;
+
+    while (!exchanges.isEmpty() && exchanges.first().finished) {
+        const Exchange exchange = exchanges.takeFirst();
+
+        out.append(exchange.http10 ? "HTTP/1.0 " : "HTTP/1.1 ");
+
+        if (!exchange.status.isEmpty()) {
+            out.append(exchange.status);
+            out.append("\r\n");
+            if (exchange.status.startsWith("405"))
+                out.append("Allow: POST\r\n");
+            out.append("Content-Length: 0\r\n");
+        } else if (exchange.response.isEmpty()) {
+            // only notifications
+            out.append("204 No Content\r\n");
+        } else {
+            out.append("200 OK\r\n"
+                       "Content-Type: application/json-rpc\r\n"
+                       "Content-Length: ");
+            out.append(QByteArray::number(exchange.response.size()));
+            out.append("\r\n");
+        }
+
+        if (!exchange.keepAlive)
+            out.append("Connection: close\r\n");
+        else if (exchange.http10)
+            out.append("Connection: keep-alive\r\n");
+
+        out.append("\r\n");
+        out.append(exchange.response);
+
+        if (exchange.peer)
+            idlePeers.push_back(exchange.peer);
+
+        if (!exchange.keepAlive) {
+            close = true;
+            break;
+        }
+    }
+
+    if (!out.isEmpty())
+        socket->write(out);
+
+    if (close) {
+        exchanges.clear();
+        socket->disconnectFromHost();
+        return;
+    }
+
+    if (exchanges.isEmpty() && !closing && keepAliveTimeout > 0)
+        idleTimer->start(keepAliveTimeout);
+
+    resumeReading();
+}
+
+void HttpConnection::resumeReading()
+{
+    // the outbound buffer must drain to half of the limit, so the reading
+    // isn't paused and resumed once per response
+    if (!stalled
+            || (maxInFlightRequests > 0
+                && exchanges.size() >= maxInFlightRequests)
+            || (maxBufferedBytes > 0
+                && socket->bytesToWrite() > maxBufferedBytes / 2))
+        return;
+
+    stalled = false;
+    socket->setReadBufferSize(0);
+
+    // handles the requests already buffered, it's queued because this
+    // function can be called while a request is being handled
+    QMetaObject::invokeMethod(this, "onReadyRead", Qt::QueuedConnection);
+}
+
+bool HttpConnection::overLimits() const
+{
+    return (maxInFlightRequests > 0 && exchanges.size() >= maxInFlightRequests)
+            || (maxBufferedBytes > 0
+                && socket->bytesToWrite() > maxBufferedBytes);
+}
+
+void HttpConnection::fail(const QByteArray &status)
+{
+    Exchange exchange;
+    exchange.peer = NULL;
+    exchange.status = status;
+    exchange.finished = true;
+    exchange.keepAlive = false;
+    exchange.http10 = false;
+    exchanges.push_back(exchange);
+
+    closing = true;
+}
+
+Peer *HttpConnection::takePeer()
+{
+    if (!idlePeers.isEmpty())
+        return idlePeers.takeLast();
+
+    Peer *peer = new Peer(this);
+    peer->setMethodRegistry(server->methodRegistry());
+    peer->setMetrics(server->metrics());
+
+    connect(peer, SIGNAL(readyResponseMessage(QByteArray)),
+            this, SLOT(onResponseMessage(QByteArray)));
+    connect(peer, SIGNAL(requestsFinished(int)),
+            this, SLOT(onRequestsFinished(int)));
+
+    connect(peer,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)),
+            this,
+            SLOT(onReadyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+
+    return peer;
+}
+
+HttpServer::HttpServer(QObject *parent) :
+    QTcpServer(parent),
+    m_threadCount(qMax(1, QThread::idealThreadCount())),
+    m_keepAliveTimeout(30000),
+    m_maxRequestSize(16 * 1024 * 1024),
+    m_maxInFlightRequests(32),
+    m_maxBufferedBytes(0),
+    m_methodRegistry(new MethodRegistry(this)),
+    m_metrics(NULL)
+{
+    qRegisterMetaType< QSharedPointer<JsonRPC::ResponseHandler> >
+            ("QSharedPointer<JsonRPC::ResponseHandler>");
+}
+
+HttpServer::~HttpServer()
+{
+    close();
+
+    // stops the threads before the registry is destroyed
+    qDeleteAll(workers);
+}
+
+int HttpServer::threadCount() const
+{
+    return m_threadCount;
+}
+
+void HttpServer::setThreadCount(int count)
+{
+    if (count > 0)
+        m_threadCount = count;
+}
+
+int HttpServer::keepAliveTimeout() const
+{
+    return m_keepAliveTimeout;
+}
+
+void HttpServer::setKeepAliveTimeout(int msecs)
+{
+    m_keepAliveTimeout = qMax(0, msecs);
+}
+
+int HttpServer::maxRequestSize() const
+{
+    return m_maxRequestSize;
+}
+
+void HttpServer::setMaxRequestSize(int size)
+{
+    if (size > 0)
+        m_maxRequestSize = size;
+}
+
+int HttpServer::maxInFlightRequests() const
+{
+    return m_maxInFlightRequests;
+}
+
+void HttpServer::setMaxInFlightRequests(int max)
+{
+    m_maxInFlightRequests = qMax(0, max);
+}
+
+qint64 HttpServer::maxBufferedBytes() const
+{
+    return m_maxBufferedBytes;
+}
+
+void HttpServer::setMaxBufferedBytes(qint64 max)
+{
+    m_maxBufferedBytes = qMax(qint64(0), max);
+}
+
+MethodRegistry *HttpServer::methodRegistry() const
+{
+    return m_methodRegistry;
+}
+
+bool HttpServer::registerMethod(const QString &name, QObject *receiver,
+                                const char *member,
+                                MethodRegistry::ExecutionMode mode)
+{
+    return m_methodRegistry->registerMethod(name, receiver, member, mode);
+}
+
+bool HttpServer::registerMethod(const QString &name, AbstractMethod *method,
+                                MethodRegistry::ExecutionMode mode)
+{
+    return m_methodRegistry->registerMethod(name, method, mode);
+}
+
+Metrics *HttpServer::metrics() const
+{
+    return m_metrics;
+}
+
+void HttpServer::setMetrics(Metrics *metrics)
+{
+    m_metrics = metrics;
+}
+
+int HttpServer::connectionCount() const
+{
+    int count = 0;
+    Q_FOREACH (HttpServerWorker *worker, workers)
+        count += worker->connections;
+    return count;
+}
+
+void HttpServer::incomingConnection(int socketDescriptor)
+{
+    if (workers.isEmpty())
+        startWorkers();
+
+    // the worker thread with fewer connections is used
+    HttpServerWorker *worker = workers.first();
+    Q_FOREACH (HttpServerWorker *candidate, workers) {
+        if (candidate->connections < worker->connections)
+            worker = candidate;
+    }
+    worker->connections.ref();
+
+    const int keepAliveTimeout = m_keepAliveTimeout;
+    const int maxRequestSize = m_maxRequestSize;
+    const int maxInFlightRequests = m_maxInFlightRequests;
+    const qlonglong maxBufferedBytes = m_maxBufferedBytes;
+
+    QMetaObject::invokeMethod(worker, "addConnection", Qt::QueuedConnection,
+                              Q_ARG(int, socketDescriptor),
+                              Q_ARG(int, keepAliveTimeout),
+                              Q_ARG(int, maxRequestSize),
+                              Q_ARG(int, maxInFlightRequests),
+                              Q_ARG(qlonglong, maxBufferedBytes));
+}
+
+bool HttpServer::forwardsRequests() const
+{
+    return receivers(SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+}
+
+void HttpServer::startWorkers()
+{
+    for (int i = 0;i != m_threadCount;++i)
+        workers.push_back(new HttpServerWorker(this));
+}
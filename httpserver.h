@@ -0,0 +1,191 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_HTTPSERVER_H
+#define QTJSONRPC_HTTPSERVER_H
+
+#include <QTcpServer>
+#include <QList>
+
+#include "peer.h"
+
+namespace JsonRPC {
+
+class HttpConnection;
+class HttpServerWorker;
+
+/*!
+  HttpServer answers JSON-RPC requests sent as HTTP POST requests, like
+  the ones made by HttpHelper, so no external HTTP server is needed.
+  The connections are spread among a set of worker threads, each one
+  running its own event loop, like in TcpServer.
+
+  The connections are persistent (HTTP/1.1 keep-alive) and the requests
+  can be pipelined: the requests of a connection are handled as soon as
+  they arrive and their responses are sent in the order of the requests.
+  The body can be sent with a Content-Length or with the chunked
+  transfer encoding. Requests made only of notifications are answered
+  with "204 No Content".
+
+  All connections share the same MethodRegistry, so the methods only need
+  to be registered once.
+  Requests for methods that aren't in the registry are emitted through
+  the readyRequest signal, in the thread of the server. If nothing is
+  connected to this signal, they are answered with a METHOD_NOT_FOUND
+  error. This is checked for each request, so the signal can be
+  connected at any time.
+  @warning the registered methods are called from the worker threads, so
+  they must be thread-safe.
+  */
+class HttpServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit HttpServer(QObject *parent = 0);
+    /*!
+      Closes all connections and stops the worker threads.
+      */
+    ~HttpServer();
+
+    /*!
+      @return the number of worker threads.
+      */
+    int threadCount() const;
+    /*! Sets the number of worker threads.
+      The default is QThread::idealThreadCount().
+      It only takes effect if it's called before the first connection is
+      accepted.
+      */
+    void setThreadCount(int count);
+
+    /*!
+      @return the time, in milliseconds, that an idle connection is kept
+      open.
+      */
+    int keepAliveTimeout() const;
+    /*! Sets the time, in milliseconds, that an idle connection is kept
+      open to \param msecs. 0 means that idle connections are never
+      closed by the server.
+      The default is 30000. It's applied to new connections.
+      */
+    void setKeepAliveTimeout(int msecs);
+
+    /*!
+      @return the maximum size of a request, in bytes.
+      */
+    int maxRequestSize() const;
+    /*! Sets the maximum size of a request (header and body) to
+      \param size bytes. Larger requests are answered with
+      "413 Request Entity Too Large" and the connection is closed.
+      The default is 16 MiB. It's applied to new connections.
+      */
+    void setMaxRequestSize(int size);
+
+    /*!
+      @return the maximum number of requests of each connection waiting
+      for a response, or 0 if there is no limit.
+      */
+    int maxInFlightRequests() const;
+    /*! Sets the maximum number of HTTP requests of each connection
+      waiting for a response to \param max. When it's reached, the
+      connection isn't read until some of them are answered.
+      The default is 32. It's applied to new connections.
+      */
+    void setMaxInFlightRequests(int max);
+    /*!
+      @return the maximum number of outbound bytes of each connection
+      waiting to be written, or 0 if there is no limit.
+      */
+    qint64 maxBufferedBytes() const;
+    /*! Sets the maximum number of outbound bytes of each connection
+      waiting to be written to \param max. When it's exceeded, the
+      connection isn't read until the outbound data drains to half of
+      \param max.
+      The default is 0 (no limit). It's applied to new connections.
+      */
+    void setMaxBufferedBytes(qint64 max);
+
+    /*!
+      @return the registry shared by all connections.
+      */
+    MethodRegistry *methodRegistry() const;
+    /*!
+      Registers the method \param name in the registry shared by all
+      connections.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, QObject *receiver,
+                        const char *member,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the method \param name in the registry shared by all
+      connections.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, AbstractMethod *method,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the function \param function as the method \param name
+      in the registry shared by all connections.
+      @sa MethodRegistry::registerFunction
+      */
+    template<typename Function>
+    bool registerFunction(const QString &name, Function function,
+                          const QStringList &names = QStringList(),
+                          MethodRegistry::ExecutionMode mode
+                          = MethodRegistry::DIRECT_EXECUTION)
+    {
+        return m_methodRegistry->registerFunction(name, function, names, mode);
+    }
+
+    /*!
+      @return the object where the requests of all connections are
+      recorded, or NULL if none.
+      */
+    Metrics *metrics() const;
+    /*!
+      Sets the object where the requests of all connections are recorded
+      to \param metrics. The server doesn't take the ownership of
+      \param metrics. It's applied to new connections.
+      @sa Peer::setMetrics
+      */
+    void setMetrics(Metrics *metrics);
+
+    /*!
+      @return the number of open connections.
+      */
+    int connectionCount() const;
+
+signals:
+    /*!
+      Emitted when a new request message is available and its method
+      isn't in the method registry.
+      /param handler is the object that you use to send a response.
+      */
+    void readyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+
+protected:
+    void incomingConnection(int socketDescriptor);
+
+private:
+    friend class HttpConnection;
+
+    void startWorkers();
+    // it can be called from the worker threads
+    bool forwardsRequests() const;
+
+    int m_threadCount;
+    int m_keepAliveTimeout;
+    int m_maxRequestSize;
+    int m_maxInFlightRequests;
+    qint64 m_maxBufferedBytes;
+    MethodRegistry *m_methodRegistry;
+    Metrics *m_metrics;
+
+    QList<HttpServerWorker *> workers;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_HTTPSERVER_H
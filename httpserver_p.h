@@ -0,0 +1,142 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_HTTPSERVER_P_H
+#define QTJSONRPC_HTTPSERVER_P_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QList>
+#include <QSharedPointer>
+
+class QThread;
+class QTcpSocket;
+class QTimer;
+
+namespace JsonRPC {
+
+class HttpServer;
+class Peer;
+class ResponseHandler;
+
+/*!
+  Owns the connections of one worker thread of a HttpServer.
+  It lives in its own thread, so all slots run in that thread.
+  @warning this file is private, it should be included only by
+  httpserver.cpp
+  */
+class HttpServerWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit HttpServerWorker(HttpServer *server);
+    ~HttpServerWorker();
+
+    /*!
+      Number of open connections. It's incremented by the server when a
+      connection is assigned to this worker, so the load balancing sees it
+      immediately.
+      */
+    QAtomicInt connections;
+
+public slots:
+    void addConnection(int socketDescriptor, int keepAliveTimeout,
+                       int maxRequestSize, int maxInFlightRequests,
+                       qlonglong maxBufferedBytes);
+
+private slots:
+    void onClosed();
+    void closeConnections();
+
+private:
+    HttpServer *server;
+    QThread *thread;
+};
+
+/*!
+  A HTTP connection of a HttpServer.
+  Each request is handled by its own Peer, so the responses can be
+  matched to the requests and sent in order, even when they are produced
+  out of order. The peers are reused by the next requests.
+  @warning this file is private, it should be included only by
+  httpserver.cpp
+  */
+class HttpConnection : public QObject
+{
+    Q_OBJECT
+public:
+    HttpConnection(QTcpSocket *socket, HttpServer *server,
+                   int keepAliveTimeout, int maxRequestSize,
+                   int maxInFlightRequests, qint64 maxBufferedBytes,
+                   QObject *parent);
+
+signals:
+    void closed();
+    void readyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+
+private slots:
+    void onReadyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+    void onReadyRead();
+    void onDisconnected();
+    void onResponseMessage(const QByteArray &json);
+    void onRequestsFinished(int inFlightCount);
+    void onTimeout();
+    void resumeReading();
+
+private:
+    enum ParseResult
+    {
+        INCOMPLETE,
+        COMPLETE,
+        BAD_REQUEST,
+        TOO_LARGE
+    };
+
+    // a request waiting for its response to be written
+    struct Exchange
+    {
+        Peer *peer;
+        QByteArray response;
+        // the status line for responses made by the connection itself
+        QByteArray status;
+        bool finished;
+        bool keepAlive;
+        bool http10;
+    };
+
+    ParseResult parseRequest(QByteArray &body, bool &post, bool &keepAlive,
+                             bool &http10);
+    ParseResult parseChunkedBody(int begin, QByteArray &body, int &end) const;
+    int findExchange(Peer *peer) const;
+    void finishExchange(Peer *peer);
+    void writeResponses();
+    void fail(const QByteArray &status);
+    bool overLimits() const;
+    Peer *takePeer();
+
+    QTcpSocket *socket;
+    HttpServer *server;
+    const int keepAliveTimeout;
+    const int maxRequestSize;
+    const int maxInFlightRequests;
+    const qint64 maxBufferedBytes;
+    QTimer *idleTimer;
+
+    // bytes before bufferOffset were already handled
+    QByteArray buffer;
+    int bufferOffset;
+    // "100 Continue" was sent for the request being received
+    bool continueSent;
+    // no more requests are read, the connection is closed after the
+    // pending responses
+    bool closing;
+    // the limits were reached, the socket isn't being read
+    bool stalled;
+
+    QList<Exchange> exchanges;
+    QList<Peer *> idlePeers;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_HTTPSERVER_P_H
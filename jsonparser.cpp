@@ -0,0 +1,708 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "jsonparser.h"
+#include "rawvalue.h"
+
+#include <QVariantMap>
+#include <QVariantList>
+
+using namespace JsonRPC;
+
+namespace {
+
+// protects the stack against maliciously nested messages
+const int MAX_DEPTH = 512;
+
+inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+inline void appendUtf8(QByteArray &out, uint ucs4)
+{
+    if (ucs4 < 0x80) {
+        out.append(char(ucs4));
+    } else if (ucs4 < 0x800) {
+        out.append(char(0xc0 | (ucs4 >> 6)));
+        out.append(char(0x80 | (ucs4 & 0x3f)));
+    } else if (ucs4 < 0x10000) {
+        out.append(char(0xe0 | (ucs4 >> 12)));
+        out.append(char(0x80 | ((ucs4 >> 6) & 0x3f)));
+        out.append(char(0x80 | (ucs4 & 0x3f)));
+    } else {
+        out.append(char(0xf0 | (ucs4 >> 18)));
+        out.append(char(0x80 | ((ucs4 >> 12) & 0x3f)));
+        out.append(char(0x80 | ((ucs4 >> 6) & 0x3f)));
+        out.append(char(0x80 | (ucs4 & 0x3f)));
+    }
+}
+
+class Parser
+{
+public:
+    Parser(const char *begin, const char *end, int options = 0) :
+        pos(begin),
+        end(end),
+        depth(0),
+        options(options),
+        rootIsArray(false)
+    {
+    }
+
+    bool parseDocument(QVariant &value)
+    {
+        skipSpaces();
+        rootIsArray = pos != end && *pos == '[';
+        if (!parseValue(value))
+            return false;
+        skipSpaces();
+        return pos == end;
+    }
+
+    bool parseMember(const QString &key, QVariant &value)
+    {
+        skipSpaces();
+        if (pos == end || *pos != '{')
+            return false;
+
+        ++pos;
+        skipSpaces();
+
+        if (pos != end && *pos == '}')
+            return true;
+
+        while (true) {
+            if (pos == end || *pos != '"')
+                return false;
+
+            QString name;
+            if (!parseString(name))
+                return false;
+
+            skipSpaces();
+            if (pos == end || *pos != ':')
+                return false;
+            ++pos;
+            skipSpaces();
+
+            // the last occurrence wins, like in parseObject
+            if (name == key) {
+                if (!parseValue(value))
+                    return false;
+            } else if (!skipValue()) {
+                return false;
+            }
+
+            skipSpaces();
+            if (pos == end)
+                return false;
+
+            if (*pos == ',') {
+                ++pos;
+                skipSpaces();
+            } else {
+                return *pos == '}';
+            }
+        }
+    }
+
+    bool parseElement(int index, QVariant &value)
+    {
+        skipSpaces();
+        if (pos == end || *pos != '[')
+            return false;
+
+        ++pos;
+        skipSpaces();
+
+        if (pos != end && *pos == ']')
+            return true;
+
+        for (int i = 0;;++i) {
+            if (i == index) {
+                // the remaining elements were validated by the parse that
+                // produced this value
+                return parseValue(value);
+            }
+
+            if (!skipValue())
+                return false;
+
+            skipSpaces();
+            if (pos == end)
+                return false;
+
+            if (*pos == ',') {
+                ++pos;
+                skipSpaces();
+            } else {
+                return *pos == ']';
+            }
+        }
+    }
+
+private:
+    void skipSpaces()
+    {
+        while (pos != end && isSpace(*pos))
+            ++pos;
+    }
+
+    bool consume(const char *literal, int size)
+    {
+        if (end - pos < size)
+            return false;
+
+        for (int i = 0;i != size;++i) {
+            if (pos[i] != literal[i])
+                return false;
+        }
+
+        pos += size;
+        return true;
+    }
+
+    bool parseValue(QVariant &value)
+    {
+        if (pos == end)
+            return false;
+
+        switch (*pos) {
+        case '{':
+            return parseObject(value);
+        case '[':
+            return parseArray(value);
+        case '"':
+        {
+            QString string;
+            if (!parseString(string))
+                return false;
+            value = string;
+            return true;
+        }
+        case 't':
+            value = true;
+            return consume("true", 4);
+        case 'f':
+            value = false;
+            return consume("false", 5);
+        case 'n':
+            value = QVariant();
+            return consume("null", 4);
+        default:
+            return parseNumber(value);
+        }
+    }
+
+    // validates a value without decoding it
+    bool skipValue()
+    {
+        if (pos == end)
+            return false;
+
+        switch (*pos) {
+        case '{':
+            return skipContainer('}');
+        case '[':
+            return skipContainer(']');
+        case '"':
+            return skipString();
+        case 't':
+            return consume("true", 4);
+        case 'f':
+            return consume("false", 5);
+        case 'n':
+            return consume("null", 4);
+        default:
+        {
+            bool negative;
+            quint64 magnitude;
+            bool isDouble;
+            return scanNumber(negative, magnitude, isDouble);
+        }
+        }
+    }
+
+    bool skipContainer(char close)
+    {
+        if (++depth > MAX_DEPTH)
+            return false;
+
+        const bool isObject = close == '}';
+
+        // skip '{' or '['
+        ++pos;
+        skipSpaces();
+
+        if (pos != end && *pos == close) {
+            ++pos;
+            --depth;
+            return true;
+        }
+
+        while (true) {
+            if (isObject) {
+                if (pos == end || *pos != '"' || !skipString())
+                    return false;
+
+                skipSpaces();
+                if (pos == end || *pos != ':')
+                    return false;
+                ++pos;
+                skipSpaces();
+            }
+
+            if (!skipValue())
+                return false;
+
+            skipSpaces();
+            if (pos == end)
+                return false;
+
+            if (*pos == ',') {
+                ++pos;
+                skipSpaces();
+            } else if (*pos == close) {
+                ++pos;
+                break;
+            } else {
+                return false;
+            }
+        }
+
+        --depth;
+        return true;
+    }
+
+    bool skipString()
+    {
+        // skip '"'
+        ++pos;
+
+        while (pos != end && *pos != '"') {
+            if (uchar(*pos) < 0x20)
+                return false;
+
+            if (*pos++ != '\\')
+                continue;
+
+            if (pos == end)
+                return false;
+
+            switch (*pos++) {
+            case '"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't':
+                break;
+            case 'u':
+            {
+                uint ucs4;
+                if (!parseEscapedCodePoint(ucs4))
+                    return false;
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+
+        if (pos == end)
+            return false;
+
+        // skip '"'
+        ++pos;
+        return true;
+    }
+
+    bool parseObject(QVariant &value)
+    {
+        if (++depth > MAX_DEPTH)
+            return false;
+
+        // skip '{'
+        ++pos;
+        skipSpaces();
+
+        // the params of a request or of a request in a batch
+        const bool rawParams = (options & JsonParser::RAW_PARAMS)
+                && (depth == 1 || (depth == 2 && rootIsArray));
+
+        QVariantMap object;
+
+        if (pos != end && *pos == '}') {
+            ++pos;
+            --depth;
+            value = object;
+            return true;
+        }
+
+        while (true) {
+            if (pos == end || *pos != '"')
+                return false;
+
+            QString key;
+            if (!parseString(key))
+                return false;
+
+            skipSpaces();
+            if (pos == end || *pos != ':')
+                return false;
+            ++pos;
+            skipSpaces();
+
+            QVariant member;
+            if (rawParams && key == QLatin1String("params")) {
+                const char *begin = pos;
+                if (!skipValue())
+                    return false;
+                member = QVariant::fromValue(RawValue(QByteArray(begin, pos - begin),
+                                                      RawValue::JSON_FORMAT));
+            } else if (!parseValue(member)) {
+                return false;
+            }
+            object.insert(key, member);
+
+            skipSpaces();
+            if (pos == end)
+                return false;
+
+            if (*pos == ',') {
+                ++pos;
+                skipSpaces();
+            } else if (*pos == '}') {
+                ++pos;
+                break;
+            } else {
+                return false;
+            }
+        }
+
+        --depth;
+        value = object;
+        return true;
+    }
+
+    bool parseArray(QVariant &value)
+    {
+        if (++depth > MAX_DEPTH)
+            return false;
+
+        // skip '['
+        ++pos;
+        skipSpaces();
+
+        QVariantList array;
+
+        if (pos != end && *pos == ']') {
+            ++pos;
+            --depth;
+            value = array;
+            return true;
+        }
+
+        while (true) {
+            QVariant element;
+            if (!parseValue(element))
+                return false;
+            array.push_back(element);
+
+            skipSpaces();
+            if (pos == end)
+                return false;
+
+            if (*pos == ',') {
+                ++pos;
+                skipSpaces();
+            } else if (*pos == ']') {
+                ++pos;
+                break;
+            } else {
+                return false;
+            }
+        }
+
+        --depth;
+        value = array;
+        return true;
+    }
+
+    bool parseString(QString &string)
+    {
+        // skip '"'
+        const char *begin = ++pos;
+
+        // fast path: no escape sequences, decode the bytes in place
+        while (pos != end && *pos != '"' && *pos != '\\') {
+            if (uchar(*pos) < 0x20)
+                return false;
+            ++pos;
+        }
+
+        if (pos == end)
+            return false;
+
+        if (*pos == '"') {
+            string = QString::fromUtf8(begin, pos - begin);
+            ++pos;
+            return true;
+        }
+
+        // slow path: unescape into a temporary UTF-8 buffer
+        QByteArray buffer(begin, pos - begin);
+
+        while (pos != end && *pos != '"') {
+            if (uchar(*pos) < 0x20)
+                return false;
+
+            if (*pos != '\\') {
+                buffer.append(*pos++);
+                continue;
+            }
+
+            if (++pos == end)
+                return false;
+
+            switch (*pos++) {
+            case '"':
+                buffer.append('"');
+                break;
+            case '\\':
+                buffer.append('\\');
+                break;
+            case '/':
+                buffer.append('/');
+                break;
+            case 'b':
+                buffer.append('\b');
+                break;
+            case 'f':
+                buffer.append('\f');
+                break;
+            case 'n':
+                buffer.append('\n');
+                break;
+            case 'r':
+                buffer.append('\r');
+                break;
+            case 't':
+                buffer.append('\t');
+                break;
+            case 'u':
+            {
+                uint ucs4;
+                if (!parseEscapedCodePoint(ucs4))
+                    return false;
+                appendUtf8(buffer, ucs4);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+
+        if (pos == end)
+            return false;
+
+        // skip '"'
+        ++pos;
+        string = QString::fromUtf8(buffer.constData(), buffer.size());
+        return true;
+    }
+
+    bool parseHex4(uint &value)
+    {
+        if (end - pos < 4)
+            return false;
+
+        value = 0;
+        for (int i = 0;i != 4;++i) {
+            int digit = hexValue(*pos++);
+            if (digit < 0)
+                return false;
+            value = (value << 4) | digit;
+        }
+        return true;
+    }
+
+    bool parseEscapedCodePoint(uint &ucs4)
+    {
+        if (!parseHex4(ucs4))
+            return false;
+
+        if (ucs4 >= 0xd800 && ucs4 < 0xdc00) {
+            // high surrogate, must be followed by a low surrogate
+            uint low;
+            if (end - pos < 2 || pos[0] != '\\' || pos[1] != 'u')
+                return false;
+            pos += 2;
+            if (!parseHex4(low) || low < 0xdc00 || low >= 0xe000)
+                return false;
+            ucs4 = 0x10000 + ((ucs4 - 0xd800) << 10) + (low - 0xdc00);
+        } else if (ucs4 >= 0xdc00 && ucs4 < 0xe000) {
+            return false;
+        }
+
+        return true;
+    }
+
+    // checks the number grammar, magnitude is only meaningful for
+    // integers that don't overflow
+    bool scanNumber(bool &negative, quint64 &magnitude, bool &isDouble)
+    {
+        negative = false;
+
+        if (*pos == '-') {
+            negative = true;
+            ++pos;
+        }
+
+        if (pos == end || !isDigit(*pos))
+            return false;
+
+        // leading zeros are not allowed
+        if (*pos == '0' && pos + 1 != end && isDigit(pos[1]))
+            return false;
+
+        magnitude = 0;
+        bool overflow = false;
+        while (pos != end && isDigit(*pos)) {
+            const uint digit = *pos++ - '0';
+            if (magnitude > (Q_UINT64_C(0xffffffffffffffff) - digit) / 10)
+                overflow = true;
+            else
+                magnitude = magnitude * 10 + digit;
+        }
+
+        isDouble = overflow;
+
+        if (pos != end && *pos == '.') {
+            ++pos;
+            if (pos == end || !isDigit(*pos))
+                return false;
+            while (pos != end && isDigit(*pos))
+                ++pos;
+            isDouble = true;
+        }
+
+        if (pos != end && (*pos == 'e' || *pos == 'E')) {
+            ++pos;
+            if (pos != end && (*pos == '+' || *pos == '-'))
+                ++pos;
+            if (pos == end || !isDigit(*pos))
+                return false;
+            while (pos != end && isDigit(*pos))
+                ++pos;
+            isDouble = true;
+        }
+
+        return true;
+    }
+
+    bool parseNumber(QVariant &value)
+    {
+        const char *begin = pos;
+        bool negative;
+        quint64 magnitude;
+        bool isDouble;
+
+        if (!scanNumber(negative, magnitude, isDouble))
+            return false;
+
+        if (isDouble) {
+            bool ok;
+            double number = QByteArray::fromRawData(begin, pos - begin).toDouble(&ok);
+            value = number;
+            return ok;
+        }
+
+        if (negative) {
+            if (magnitude <= Q_UINT64_C(0x80000000))
+                value = int(-qint64(magnitude));
+            else if (magnitude <= Q_UINT64_C(0x8000000000000000))
+                value = qlonglong(-qint64(magnitude - 1) - 1);
+            else
+                value = -double(magnitude);
+        } else {
+            if (magnitude <= Q_UINT64_C(0x7fffffff))
+                value = int(magnitude);
+            else if (magnitude <= Q_UINT64_C(0x7fffffffffffffff))
+                value = qlonglong(magnitude);
+            else
+                value = qulonglong(magnitude);
+        }
+
+        return true;
+    }
+
+    const char *pos;
+    const char *const end;
+    int depth;
+    const int options;
+    bool rootIsArray;
+};
+
+} // namespace
+
+QVariant JsonParser::parse(const QByteArray &json, bool &ok, int options)
+{
+    return parse(json.constData(), json.size(), ok, options);
+}
+
+QVariant JsonParser::parse(const char *json, int size, bool &ok, int options)
+{
+    QVariant value;
+    Parser parser(json, json + size, options);
+
+    ok = parser.parseDocument(value);
+    if (!ok)
+        return QVariant();
+
+    return value;
+}
+
+QVariant JsonParser::parseMember(const char *json, int size,
+                                 const QString &key, bool &ok)
+{
+    QVariant value;
+    Parser parser(json, json + size);
+
+    ok = parser.parseMember(key, value);
+    if (!ok)
+        return QVariant();
+
+    return value;
+}
+
+QVariant JsonParser::parseElement(const char *json, int size, int index,
+                                  bool &ok)
+{
+    QVariant value;
+    Parser parser(json, json + size);
+
+    ok = parser.parseElement(index, value);
+    if (!ok)
+        return QVariant();
+
+    return value;
+}
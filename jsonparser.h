@@ -0,0 +1,70 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_JSONPARSER_H
+#define QTJSONRPC_JSONPARSER_H
+
+#include <QVariant>
+#include <QByteArray>
+
+namespace JsonRPC {
+
+/*!
+  JSON parser that works directly over UTF-8 encoded data.
+  Unlike QtJson::Json::parse, it doesn't need a QString copy of the whole
+  message, only the strings inside the message are decoded.
+
+  The generated tree uses the same types used by the qt-json library:
+  QVariantMap for objects, QVariantList for arrays, QString for strings,
+  bool for booleans, a null QVariant for null and int, qlonglong,
+  qulonglong or double for numbers (the smallest type that can hold the
+  value without losing precision).
+  */
+class JsonParser
+{
+public:
+    enum Option
+    {
+        NO_OPTIONS = 0x0,
+        /*! The "params" member of the top-level object, or of the objects
+          in a top-level array, is validated but not decoded. It's stored
+          as a RawValue, that can be decoded later.
+          */
+        RAW_PARAMS = 0x1
+    };
+
+    /*!
+      Parses \param json, a UTF-8 encoded JSON text.
+      \param ok is set to true if \param json is a valid JSON text.
+      \param options is a combination of the Option flags.
+      @return the parsed value, or a null QVariant if \param ok is false.
+      */
+    static QVariant parse(const QByteArray &json, bool &ok,
+                          int options = NO_OPTIONS);
+    /*!
+      Parses the \param size bytes starting at \param json.
+      @sa parse
+      */
+    static QVariant parse(const char *json, int size, bool &ok,
+                          int options = NO_OPTIONS);
+
+    /*!
+      Parses only the member \param key of the JSON object in \param json.
+      The other members are skipped without being decoded.
+      \param ok is set to false if \param json isn't a valid JSON object.
+      @return the member, or a null QVariant if it doesn't exist.
+      */
+    static QVariant parseMember(const char *json, int size,
+                                const QString &key, bool &ok);
+    /*!
+      Parses only the element \param index of the JSON array in
+      \param json. The other elements are skipped without being decoded.
+      \param ok is set to false if \param json isn't a valid JSON array.
+      @return the element, or a null QVariant if it doesn't exist.
+      */
+    static QVariant parseElement(const char *json, int size, int index,
+                                 bool &ok);
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_JSONPARSER_H
@@ -0,0 +1,473 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "methodregistry.h"
+#include "cbor.h"
+#include "responsehandler.h"
+#include "resultcache.h"
+
+#include <QMetaMethod>
+#include <QPointer>
+#include <QThreadPool>
+#include <QRunnable>
+
+#include <limits.h>
+
+using namespace JsonRPC;
+
+namespace {
+
+/*!
+  Method implemented by a slot of a QObject.
+  The slot is resolved once, at registration time, and called directly,
+  without looking it up by name for each request.
+  */
+class SlotMethod: public AbstractMethod
+{
+public:
+    SlotMethod(QObject *receiver, const QMetaMethod &slot) :
+        receiver(receiver),
+        slot(slot)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        if (!receiver) {
+            handler->error(Error(METHOD_NOT_FOUND));
+            return;
+        }
+
+        slot.invoke(receiver, Qt::DirectConnection,
+                    Q_ARG(QSharedPointer<JsonRPC::ResponseHandler>, handler));
+    }
+
+private:
+    QPointer<QObject> receiver;
+    QMetaMethod slot;
+};
+
+/*!
+  Runs a method in a thread of a QThreadPool.
+  */
+class MethodRunnable: public QRunnable
+{
+public:
+    MethodRunnable(const QSharedPointer<AbstractMethod> &method,
+                   const QSharedPointer<ResponseHandler> &handler) :
+        method(method),
+        handler(handler)
+    {
+    }
+
+    void run()
+    {
+        method->invoke(handler);
+    }
+
+private:
+    QSharedPointer<AbstractMethod> method;
+    QSharedPointer<ResponseHandler> handler;
+};
+
+// checks the range of integer params
+bool toInteger(const QVariant &value, qlonglong min, qlonglong max,
+               qlonglong &result)
+{
+    switch (value.type()) {
+    case QVariant::Int:
+    case QVariant::LongLong:
+        result = value.toLongLong();
+        break;
+    case QVariant::UInt:
+    case QVariant::ULongLong:
+        if (value.toULongLong() > quint64(max))
+            return false;
+        result = value.toLongLong();
+        break;
+    case QVariant::Double:
+    {
+        // integral numbers can be sent with a fractional part
+        const double number = value.toDouble();
+        // double(max) is rounded up to 2^63 for LLONG_MAX, which doesn't
+        // fit in a qlonglong, so the bound is exclusive: max + 1 is exact
+        // for the smaller types and stays 2^63 for qlonglong. NaN fails
+        // both comparisons.
+        if (!(number >= double(min) && number < double(max) + 1.0))
+            return false;
+        result = qlonglong(number);
+        if (double(result) != number)
+            return false;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    return result >= min && result <= max;
+}
+
+} // namespace
+
+bool JsonRPC::fromVariant(const QVariant &value, int &result)
+{
+    qlonglong number;
+    if (!toInteger(value, INT_MIN, INT_MAX, number))
+        return false;
+
+    result = int(number);
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, uint &result)
+{
+    qlonglong number;
+    if (!toInteger(value, 0, UINT_MAX, number))
+        return false;
+
+    result = uint(number);
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, qlonglong &result)
+{
+    return toInteger(value, LLONG_MIN, LLONG_MAX, result);
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, qulonglong &result)
+{
+    if (value.type() == QVariant::ULongLong) {
+        result = value.toULongLong();
+        return true;
+    }
+
+    qlonglong number;
+    if (!toInteger(value, 0, LLONG_MAX, number))
+        return false;
+
+    result = qulonglong(number);
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, double &result)
+{
+    switch (value.type()) {
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+    case QVariant::Double:
+        result = value.toDouble();
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, bool &result)
+{
+    if (value.type() != QVariant::Bool)
+        return false;
+
+    result = value.toBool();
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, QString &result)
+{
+    if (value.type() != QVariant::String)
+        return false;
+
+    result = value.toString();
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, QByteArray &result)
+{
+    // byte strings only exist in the CBOR encoding
+    if (value.type() == QVariant::ByteArray)
+        result = value.toByteArray();
+    else if (value.type() == QVariant::String)
+        result = value.toString().toUtf8();
+    else
+        return false;
+
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, QStringList &result)
+{
+    if (value.type() != QVariant::List)
+        return false;
+
+    const QVariantList list = value.toList();
+    result.clear();
+    result.reserve(list.size());
+
+    Q_FOREACH (const QVariant &element, list) {
+        if (element.type() != QVariant::String)
+            return false;
+        result.push_back(element.toString());
+    }
+
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, QVariantList &result)
+{
+    if (value.type() != QVariant::List)
+        return false;
+
+    result = value.toList();
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, QVariantMap &result)
+{
+    if (value.type() != QVariant::Map)
+        return false;
+
+    result = value.toMap();
+    return true;
+}
+
+bool JsonRPC::fromVariant(const QVariant &value, QVariant &result)
+{
+    result = value;
+    return true;
+}
+
+QVariant JsonRPC::Binding::argument(const ResponseHandler &request,
+                                    const QStringList &names, int index)
+{
+    if (request.paramsType() == QVariant::Map) {
+        if (index < names.size())
+            return request.param(names[index]);
+        return QVariant();
+    }
+
+    return request.param(index);
+}
+
+void JsonRPC::Binding::reply(const QSharedPointer<ResponseHandler> &handler,
+                             const QVariant &result)
+{
+    handler->response(result);
+}
+
+void JsonRPC::Binding::replyInvalidParams(const QSharedPointer<ResponseHandler> &handler)
+{
+    handler->error(Error(INVALID_PARAMS));
+}
+
+AbstractMethod::~AbstractMethod()
+{
+}
+
+void AbstractMethod::notify(const ResponseHandler &request)
+{
+    invoke(request.copy());
+}
+
+MethodRegistry::MethodRegistry(QObject *parent) :
+    QObject(parent),
+    m_threadPool(QThreadPool::globalInstance())
+{
+}
+
+QThreadPool *MethodRegistry::threadPool() const
+{
+    QReadLocker locker(&lock);
+    return m_threadPool;
+}
+
+void MethodRegistry::setThreadPool(QThreadPool *pool)
+{
+    QWriteLocker locker(&lock);
+    m_threadPool = pool;
+}
+
+bool MethodRegistry::registerMethod(const QString &name, QObject *receiver,
+                                    const char *member, ExecutionMode mode)
+{
+    if (!receiver || !member)
+        return false;
+
+    // skips the code added by the SLOT macro
+    if (*member >= '0' && *member <= '2')
+        ++member;
+
+    const QMetaObject *metaObject = receiver->metaObject();
+    const int index
+            = metaObject->indexOfMethod(QMetaObject::normalizedSignature(member));
+    if (index == -1)
+        return false;
+
+    // the handler is passed by its type name, Qt refuses to invoke a slot
+    // with any other parameters
+    const QMetaMethod slot = metaObject->method(index);
+    const QList<QByteArray> types = slot.parameterTypes();
+    if (types.size() != 1
+            || types.first() != QMetaObject::normalizedType(
+                "QSharedPointer<JsonRPC::ResponseHandler>"))
+        return false;
+
+    return registerMethod(name, new SlotMethod(receiver, slot), mode);
+}
+
+bool MethodRegistry::registerMethod(const QString &name, AbstractMethod *method,
+                                    ExecutionMode mode)
+{
+    if (name.startsWith("rpc.") || !method) {
+        delete method;
+        return false;
+    }
+
+    Entry entry;
+    entry.method = QSharedPointer<AbstractMethod>(method);
+    entry.mode = mode;
+
+    QWriteLocker locker(&lock);
+    methods.insert(name, entry);
+    return true;
+}
+
+void MethodRegistry::unregisterMethod(const QString &name)
+{
+    QWriteLocker locker(&lock);
+    methods.remove(name);
+}
+
+bool MethodRegistry::setCacheable(const QString &name, int ttl, int maxSize)
+{
+    QWriteLocker locker(&lock);
+
+    QHash<QString, Entry>::iterator i = methods.find(name);
+    if (i == methods.end())
+        return false;
+
+    if (ttl > 0 && maxSize > 0)
+        i.value().cache = QSharedPointer<ResultCache>(new ResultCache(ttl, maxSize));
+    else
+        i.value().cache.clear();
+
+    return true;
+}
+
+void MethodRegistry::invalidateCache(const QString &name)
+{
+    QReadLocker locker(&lock);
+
+    const QSharedPointer<ResultCache> cache = methods.value(name).cache;
+    if (cache)
+        cache->clear();
+}
+
+void MethodRegistry::invalidateCache()
+{
+    QReadLocker locker(&lock);
+
+    for (QHash<QString, Entry>::const_iterator i = methods.constBegin();
+         i != methods.constEnd();++i) {
+        if (i.value().cache)
+            i.value().cache->clear();
+    }
+}
+
+QVariantMap MethodRegistry::cacheStatistics() const
+{
+    QVariantMap statistics;
+    QReadLocker locker(&lock);
+
+    for (QHash<QString, Entry>::const_iterator i = methods.constBegin();
+         i != methods.constEnd();++i) {
+        if (i.value().cache)
+            statistics.insert(i.key(), i.value().cache->statistics());
+    }
+
+    return statistics;
+}
+
+bool MethodRegistry::contains(const QString &name) const
+{
+    QReadLocker locker(&lock);
+    return methods.contains(name);
+}
+
+QSharedPointer<AbstractMethod> MethodRegistry::method(const QString &name) const
+{
+    QReadLocker locker(&lock);
+    return methods.value(name).method;
+}
+
+bool MethodRegistry::invoke(const QSharedPointer<ResponseHandler> &handler) const
+{
+    Entry entry;
+    QThreadPool *pool;
+    {
+        QReadLocker locker(&lock);
+
+        QHash<QString, Entry>::const_iterator i
+                = methods.constFind(handler->method());
+        if (i == methods.constEnd())
+            return false;
+
+        // the method is called without the lock, so it can change the
+        // registry
+        entry = i.value();
+        pool = m_threadPool;
+    }
+
+    if (entry.cache && handler->hasId()) {
+        // The decoded params are serialized again, so equal params have
+        // the same key whatever their original formatting. CBOR keeps the
+        // types apart (e.g. byte and text strings) and the members of the
+        // maps are sorted. Params that can't be encoded exactly aren't
+        // cached, they could share the key of other params.
+        bool exact;
+        QByteArray key(1, char(handler->encoding));
+        key.append(Cbor::serialize(handler->params(), exact));
+
+        if (exact) {
+            QByteArray result;
+            if (entry.cache->find(key, result)) {
+                handler->cachedResponse(result);
+                return true;
+            }
+
+            handler->cache = entry.cache;
+            handler->cacheKey = key;
+        }
+    }
+
+    if (entry.mode == POOLED_EXECUTION && pool)
+        pool->start(new MethodRunnable(entry.method, handler));
+    else
+        entry.method->invoke(handler);
+
+    return true;
+}
+
+bool MethodRegistry::notify(const ResponseHandler &request) const
+{
+    Entry entry;
+    QThreadPool *pool;
+    {
+        QReadLocker locker(&lock);
+
+        QHash<QString, Entry>::const_iterator i
+                = methods.constFind(request.method());
+        if (i == methods.constEnd())
+            return false;
+
+        entry = i.value();
+        pool = m_threadPool;
+    }
+
+    // request is destroyed after this call, so it's copied for the pool
+    if (entry.mode == POOLED_EXECUTION && pool)
+        pool->start(new MethodRunnable(entry.method, request.copy()));
+    else
+        entry.method->notify(request);
+
+    return true;
+}
@@ -0,0 +1,718 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_METHODREGISTRY_H
+#define QTJSONRPC_METHODREGISTRY_H
+
+#include <QObject>
+#include <QHash>
+#include <QSharedPointer>
+#include <QPointer>
+#include <QReadWriteLock>
+#include <QVariant>
+#include <QStringList>
+
+class QThreadPool;
+
+namespace JsonRPC {
+
+class ResponseHandler;
+class ResultCache;
+
+/*!
+  Base class for the methods registered in a MethodRegistry.
+  Reimplement invoke to handle the requests of the method.
+  */
+class AbstractMethod
+{
+public:
+    virtual ~AbstractMethod();
+
+    /*!
+      Handles a request for this method.
+      Use \param handler to send the response.
+      */
+    virtual void invoke(const QSharedPointer<ResponseHandler> &handler) = 0;
+    /*!
+      Handles a notification (a request without id) for this method.
+      \param request has the method and the params, and it's only valid
+      during this call. No response can be sent.
+      The default implementation copies \param request into a new
+      ResponseHandler and calls invoke. Reimplement it to handle the
+      notifications without this allocation.
+      */
+    virtual void notify(const ResponseHandler &request);
+};
+
+/*!
+  Conversions used by the typed methods to check and convert each
+  param into the type of the argument of the function.
+  They only accept values of a compatible type (e.g. an integer param
+  isn't converted to a QString), so type errors are answered with
+  INVALID_PARAMS. Integers are checked against the range of the
+  argument type. To use other argument types, declare a fromVariant
+  overload in the namespace of the type.
+  @return false if \param value can't be converted.
+  */
+bool fromVariant(const QVariant &value, int &result);
+bool fromVariant(const QVariant &value, uint &result);
+bool fromVariant(const QVariant &value, qlonglong &result);
+bool fromVariant(const QVariant &value, qulonglong &result);
+bool fromVariant(const QVariant &value, double &result);
+bool fromVariant(const QVariant &value, bool &result);
+bool fromVariant(const QVariant &value, QString &result);
+bool fromVariant(const QVariant &value, QByteArray &result);
+bool fromVariant(const QVariant &value, QStringList &result);
+bool fromVariant(const QVariant &value, QVariantList &result);
+bool fromVariant(const QVariant &value, QVariantMap &result);
+bool fromVariant(const QVariant &value, QVariant &result);
+
+/*!
+  Implementation of MethodRegistry::registerFunction.
+  */
+namespace Binding {
+
+// the type of the variable that holds an argument
+template<typename T>
+struct Argument
+{
+    typedef T Type;
+};
+
+template<typename T>
+struct Argument<const T>
+{
+    typedef T Type;
+};
+
+template<typename T>
+struct Argument<const T &>
+{
+    typedef T Type;
+};
+
+template<typename T>
+struct Argument<T &>
+{
+    typedef T Type;
+};
+
+/*!
+  @return the param \param index of the request, or the param named
+  names[\param index] if the params are a map.
+  */
+QVariant argument(const ResponseHandler &request, const QStringList &names,
+                  int index);
+void reply(const QSharedPointer<ResponseHandler> &handler,
+           const QVariant &result);
+void replyInvalidParams(const QSharedPointer<ResponseHandler> &handler);
+
+template<typename T>
+inline bool get(const ResponseHandler &request, const QStringList &names,
+                int index, T &value)
+{
+    return fromVariant(argument(request, names, index), value);
+}
+
+template<typename R>
+struct Invoker
+{
+    template<typename F>
+    static QVariant call(F f)
+    {
+        return QVariant::fromValue(f());
+    }
+
+    template<typename F, typename A1>
+    static QVariant call(F f, A1 &a1)
+    {
+        return QVariant::fromValue(f(a1));
+    }
+
+    template<typename F, typename A1, typename A2>
+    static QVariant call(F f, A1 &a1, A2 &a2)
+    {
+        return QVariant::fromValue(f(a1, a2));
+    }
+
+    template<typename F, typename A1, typename A2, typename A3>
+    static QVariant call(F f, A1 &a1, A2 &a2, A3 &a3)
+    {
+        return QVariant::fromValue(f(a1, a2, a3));
+    }
+
+    template<typename F, typename A1, typename A2, typename A3, typename A4>
+    static QVariant call(F f, A1 &a1, A2 &a2, A3 &a3, A4 &a4)
+    {
+        return QVariant::fromValue(f(a1, a2, a3, a4));
+    }
+
+    template<typename F, typename A1, typename A2, typename A3, typename A4, typename A5>
+    static QVariant call(F f, A1 &a1, A2 &a2, A3 &a3, A4 &a4, A5 &a5)
+    {
+        return QVariant::fromValue(f(a1, a2, a3, a4, a5));
+    }
+};
+
+template<>
+struct Invoker<void>
+{
+    template<typename F>
+    static QVariant call(F f)
+    {
+        f();
+        return QVariant();
+    }
+
+    template<typename F, typename A1>
+    static QVariant call(F f, A1 &a1)
+    {
+        f(a1);
+        return QVariant();
+    }
+
+    template<typename F, typename A1, typename A2>
+    static QVariant call(F f, A1 &a1, A2 &a2)
+    {
+        f(a1, a2);
+        return QVariant();
+    }
+
+    template<typename F, typename A1, typename A2, typename A3>
+    static QVariant call(F f, A1 &a1, A2 &a2, A3 &a3)
+    {
+        f(a1, a2, a3);
+        return QVariant();
+    }
+
+    template<typename F, typename A1, typename A2, typename A3, typename A4>
+    static QVariant call(F f, A1 &a1, A2 &a2, A3 &a3, A4 &a4)
+    {
+        f(a1, a2, a3, a4);
+        return QVariant();
+    }
+
+    template<typename F, typename A1, typename A2, typename A3, typename A4, typename A5>
+    static QVariant call(F f, A1 &a1, A2 &a2, A3 &a3, A4 &a4, A5 &a5)
+    {
+        f(a1, a2, a3, a4, a5);
+        return QVariant();
+    }
+};
+
+template<typename R>
+class Function0: public AbstractMethod
+{
+public:
+    typedef R (*Pointer)();
+
+    Function0(Pointer function, const QStringList &names) :
+        function(function),
+        names(names)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        QVariant result;
+
+        if (!call(*handler, result)) {
+            replyInvalidParams(handler);
+            return;
+        }
+
+        reply(handler, result);
+    }
+
+    void notify(const ResponseHandler &request)
+    {
+        // notifications with invalid params are ignored
+        QVariant result;
+        call(request, result);
+    }
+
+private:
+    bool call(const ResponseHandler &, QVariant &result)
+    {
+        result = Invoker<R>::call(function);
+        return true;
+    }
+
+    Pointer function;
+    QStringList names;
+};
+
+template<typename R, typename A1>
+class Function1: public AbstractMethod
+{
+public:
+    typedef R (*Pointer)(A1);
+
+    Function1(Pointer function, const QStringList &names) :
+        function(function),
+        names(names)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        QVariant result;
+
+        if (!call(*handler, result)) {
+            replyInvalidParams(handler);
+            return;
+        }
+
+        reply(handler, result);
+    }
+
+    void notify(const ResponseHandler &request)
+    {
+        // notifications with invalid params are ignored
+        QVariant result;
+        call(request, result);
+    }
+
+private:
+    bool call(const ResponseHandler &request, QVariant &result)
+    {
+        typename Argument<A1>::Type a1;
+
+        if (!get(request, names, 0, a1))
+            return false;
+
+        result = Invoker<R>::call(function, a1);
+        return true;
+    }
+
+    Pointer function;
+    QStringList names;
+};
+
+template<typename R, typename A1, typename A2>
+class Function2: public AbstractMethod
+{
+public:
+    typedef R (*Pointer)(A1, A2);
+
+    Function2(Pointer function, const QStringList &names) :
+        function(function),
+        names(names)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        QVariant result;
+
+        if (!call(*handler, result)) {
+            replyInvalidParams(handler);
+            return;
+        }
+
+        reply(handler, result);
+    }
+
+    void notify(const ResponseHandler &request)
+    {
+        // notifications with invalid params are ignored
+        QVariant result;
+        call(request, result);
+    }
+
+private:
+    bool call(const ResponseHandler &request, QVariant &result)
+    {
+        typename Argument<A1>::Type a1;
+        typename Argument<A2>::Type a2;
+
+        if (!get(request, names, 0, a1)
+                || !get(request, names, 1, a2))
+            return false;
+
+        result = Invoker<R>::call(function, a1, a2);
+        return true;
+    }
+
+    Pointer function;
+    QStringList names;
+};
+
+template<typename R, typename A1, typename A2, typename A3>
+class Function3: public AbstractMethod
+{
+public:
+    typedef R (*Pointer)(A1, A2, A3);
+
+    Function3(Pointer function, const QStringList &names) :
+        function(function),
+        names(names)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        QVariant result;
+
+        if (!call(*handler, result)) {
+            replyInvalidParams(handler);
+            return;
+        }
+
+        reply(handler, result);
+    }
+
+    void notify(const ResponseHandler &request)
+    {
+        // notifications with invalid params are ignored
+        QVariant result;
+        call(request, result);
+    }
+
+private:
+    bool call(const ResponseHandler &request, QVariant &result)
+    {
+        typename Argument<A1>::Type a1;
+        typename Argument<A2>::Type a2;
+        typename Argument<A3>::Type a3;
+
+        if (!get(request, names, 0, a1)
+                || !get(request, names, 1, a2)
+                || !get(request, names, 2, a3))
+            return false;
+
+        result = Invoker<R>::call(function, a1, a2, a3);
+        return true;
+    }
+
+    Pointer function;
+    QStringList names;
+};
+
+template<typename R, typename A1, typename A2, typename A3, typename A4>
+class Function4: public AbstractMethod
+{
+public:
+    typedef R (*Pointer)(A1, A2, A3, A4);
+
+    Function4(Pointer function, const QStringList &names) :
+        function(function),
+        names(names)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        QVariant result;
+
+        if (!call(*handler, result)) {
+            replyInvalidParams(handler);
+            return;
+        }
+
+        reply(handler, result);
+    }
+
+    void notify(const ResponseHandler &request)
+    {
+        // notifications with invalid params are ignored
+        QVariant result;
+        call(request, result);
+    }
+
+private:
+    bool call(const ResponseHandler &request, QVariant &result)
+    {
+        typename Argument<A1>::Type a1;
+        typename Argument<A2>::Type a2;
+        typename Argument<A3>::Type a3;
+        typename Argument<A4>::Type a4;
+
+        if (!get(request, names, 0, a1)
+                || !get(request, names, 1, a2)
+                || !get(request, names, 2, a3)
+                || !get(request, names, 3, a4))
+            return false;
+
+        result = Invoker<R>::call(function, a1, a2, a3, a4);
+        return true;
+    }
+
+    Pointer function;
+    QStringList names;
+};
+
+template<typename R, typename A1, typename A2, typename A3, typename A4, typename A5>
+class Function5: public AbstractMethod
+{
+public:
+    typedef R (*Pointer)(A1, A2, A3, A4, A5);
+
+    Function5(Pointer function, const QStringList &names) :
+        function(function),
+        names(names)
+    {
+    }
+
+    void invoke(const QSharedPointer<ResponseHandler> &handler)
+    {
+        QVariant result;
+
+        if (!call(*handler, result)) {
+            replyInvalidParams(handler);
+            return;
+        }
+
+        reply(handler, result);
+    }
+
+    void notify(const ResponseHandler &request)
+    {
+        // notifications with invalid params are ignored
+        QVariant result;
+        call(request, result);
+    }
+
+private:
+    bool call(const ResponseHandler &request, QVariant &result)
+    {
+        typename Argument<A1>::Type a1;
+        typename Argument<A2>::Type a2;
+        typename Argument<A3>::Type a3;
+        typename Argument<A4>::Type a4;
+        typename Argument<A5>::Type a5;
+
+        if (!get(request, names, 0, a1)
+                || !get(request, names, 1, a2)
+                || !get(request, names, 2, a3)
+                || !get(request, names, 3, a4)
+                || !get(request, names, 4, a5))
+            return false;
+
+        result = Invoker<R>::call(function, a1, a2, a3, a4, a5);
+        return true;
+    }
+
+    Pointer function;
+    QStringList names;
+};
+} // namespace Binding
+
+/*!
+  A table of methods used by Peer to dispatch requests.
+  The lookup is done with a hash table, so the cost of dispatching a
+  request doesn't grow with the number of registered methods.
+  A registry can be shared by several Peer objects, even if they live in
+  different threads.
+  @sa Peer::setMethodRegistry
+  */
+class MethodRegistry : public QObject
+{
+    Q_OBJECT
+public:
+    /*!
+      Where the requests of a method are handled.
+      */
+    enum ExecutionMode
+    {
+        /*! In the thread of the peer that received the request. */
+        DIRECT_EXECUTION,
+        /*! In a thread of the registry thread pool. The response is
+          sent back to the thread of the peer by the ResponseHandler.
+          @sa setThreadPool
+          */
+        POOLED_EXECUTION
+    };
+
+    explicit MethodRegistry(QObject *parent = 0);
+
+    /*!
+      @return the thread pool used to run the POOLED_EXECUTION methods.
+      */
+    QThreadPool *threadPool() const;
+    /*!
+      Sets the thread pool used to run the POOLED_EXECUTION methods.
+      The default is QThreadPool::globalInstance().
+      */
+    void setThreadPool(QThreadPool *pool);
+
+    /*!
+      Registers the slot \param member of \param receiver as the
+      method \param name, replacing any method previously registered
+      with this name.
+      The slot must have the signature
+      (QSharedPointer<JsonRPC::ResponseHandler>), e.g.:
+      \code
+      registry->registerMethod("echo", this,
+                               SLOT(echo(QSharedPointer<JsonRPC::ResponseHandler>)));
+      \endcode
+      @warning with POOLED_EXECUTION, the slot is called directly from a
+      thread of the pool, so it must be thread-safe.
+      @return true if \param name is a valid method name, according
+      the json-rpc 2.0 spec, and \param receiver has the slot with this
+      signature.
+      */
+    bool registerMethod(const QString &name, QObject *receiver,
+                        const char *member,
+                        ExecutionMode mode = DIRECT_EXECUTION);
+    /*!
+      Registers \param method as the method \param name, replacing any
+      method previously registered with this name.
+      The registry takes the ownership of \param method.
+      @return true if \param name is a valid method name, according
+      the json-rpc 2.0 spec.
+      */
+    bool registerMethod(const QString &name, AbstractMethod *method,
+                        ExecutionMode mode = DIRECT_EXECUTION);
+    /*!
+      Registers the function \param function, with up to 5 arguments,
+      as the method \param name.
+      The params are converted to the types of the arguments (see
+      fromVariant) and the requests with missing or mistyped params are
+      answered with INVALID_PARAMS, without calling \param function.
+      Positional params are passed in order. If the params are a map,
+      the argument i is the param named \param names[i].
+      The return value is the result of the response (null for void
+      functions), e.g.:
+      \code
+      double divide(double dividend, double divisor);
+
+      registry->registerFunction("divide", &divide,
+                                 QStringList() << "dividend" << "divisor");
+      \endcode
+      Extra params are ignored.
+      @return true if \param name is a valid method name, according
+      the json-rpc 2.0 spec.
+      */
+    template<typename R>
+    bool registerFunction(const QString &name, R (*function)(),
+                          const QStringList &names = QStringList(),
+                          ExecutionMode mode = DIRECT_EXECUTION)
+    {
+        return registerMethod(name,
+                              new Binding::Function0<R>(function, names),
+                              mode);
+    }
+    template<typename R, typename A1>
+    bool registerFunction(const QString &name, R (*function)(A1),
+                          const QStringList &names = QStringList(),
+                          ExecutionMode mode = DIRECT_EXECUTION)
+    {
+        return registerMethod(name,
+                              new Binding::Function1<R, A1>(function, names),
+                              mode);
+    }
+    template<typename R, typename A1, typename A2>
+    bool registerFunction(const QString &name, R (*function)(A1, A2),
+                          const QStringList &names = QStringList(),
+                          ExecutionMode mode = DIRECT_EXECUTION)
+    {
+        return registerMethod(name,
+                              new Binding::Function2<R, A1, A2>(function, names),
+                              mode);
+    }
+    template<typename R, typename A1, typename A2, typename A3>
+    bool registerFunction(const QString &name, R (*function)(A1, A2, A3),
+                          const QStringList &names = QStringList(),
+                          ExecutionMode mode = DIRECT_EXECUTION)
+    {
+        return registerMethod(name,
+                              new Binding::Function3<R, A1, A2, A3>(function, names),
+                              mode);
+    }
+    template<typename R, typename A1, typename A2, typename A3, typename A4>
+    bool registerFunction(const QString &name, R (*function)(A1, A2, A3, A4),
+                          const QStringList &names = QStringList(),
+                          ExecutionMode mode = DIRECT_EXECUTION)
+    {
+        return registerMethod(name,
+                              new Binding::Function4<R, A1, A2, A3, A4>(function, names),
+                              mode);
+    }
+    template<typename R, typename A1, typename A2, typename A3, typename A4, typename A5>
+    bool registerFunction(const QString &name, R (*function)(A1, A2, A3, A4, A5),
+                          const QStringList &names = QStringList(),
+                          ExecutionMode mode = DIRECT_EXECUTION)
+    {
+        return registerMethod(name,
+                              new Binding::Function5<R, A1, A2, A3, A4, A5>(function, names),
+                              mode);
+    }
+
+    /*!
+      Removes the method \param name.
+      */
+    void unregisterMethod(const QString &name);
+
+    /*!
+      Marks the method \param name as cacheable: its results are stored
+      for \param ttl milliseconds and the requests with the same params
+      are answered from the cache, without calling the method. The params
+      are compared after decoding, with their types, so the order of the
+      members of a map doesn't matter, but a byte string never matches a
+      text string. Only results are cached, not errors.
+      The cached results and their params take up to \param maxSize
+      bytes, the least recently used ones are discarded first.
+      A \param ttl of 0 disables the cache of the method. Registering the
+      method again also disables it.
+      @warning use it only for methods whose result depends only on the
+      params.
+      @return false if the method isn't registered.
+      */
+    bool setCacheable(const QString &name, int ttl,
+                      int maxSize = 1024 * 1024);
+    /*!
+      Removes the cached results of the method \param name.
+      */
+    void invalidateCache(const QString &name);
+    /*!
+      Removes the cached results of all methods.
+      */
+    void invalidateCache();
+    /*!
+      @return a map from the names of the cacheable methods to their
+      statistics.
+      @sa ResultCache::statistics
+      */
+    QVariantMap cacheStatistics() const;
+
+    /*!
+      @return true if a method called \param name is registered.
+      */
+    bool contains(const QString &name) const;
+    /*!
+      @return the method registered as \param name, or a null pointer.
+      */
+    QSharedPointer<AbstractMethod> method(const QString &name) const;
+
+    /*!
+      Invokes the method requested by \param handler, according its
+      execution mode.
+      @return false if the method isn't registered.
+      */
+    bool invoke(const QSharedPointer<ResponseHandler> &handler) const;
+    /*!
+      Invokes the method of the notification \param request, according
+      its execution mode. With DIRECT_EXECUTION, AbstractMethod::notify
+      is called with \param request itself. With POOLED_EXECUTION,
+      \param request is copied, so it can outlive this call.
+      @return false if the method isn't registered.
+      */
+    bool notify(const ResponseHandler &request) const;
+
+private:
+    struct Entry
+    {
+        QSharedPointer<AbstractMethod> method;
+        ExecutionMode mode;
+        // set if the method is cacheable
+        QSharedPointer<ResultCache> cache;
+    };
+
+    mutable QReadWriteLock lock;
+    QPointer<QThreadPool> m_threadPool;
+    QHash<QString, Entry> methods;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_METHODREGISTRY_H
@@ -0,0 +1,361 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "metrics.h"
+#include "responsehandler.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QStringList>
+
+using namespace JsonRPC;
+
+// upper bounds of the histogram buckets, in microseconds
+static const qint64 BUCKET_BOUNDS[] = {
+    10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+static const int BUCKET_COUNT
+        = sizeof(BUCKET_BOUNDS) / sizeof(BUCKET_BOUNDS[0]) + 1;
+
+/*
+  64-bit counter. Qt 4 only has 32-bit atomic integers, that would
+  overflow in a few minutes for the sums of nanoseconds, so the compiler
+  builtins are used when they're available.
+  */
+class Metrics::Counter
+{
+public:
+    Counter() : value(0) {}
+
+    void add(qint64 n)
+    {
+#if defined(Q_CC_GNU)
+        __sync_fetch_and_add(&value, n);
+#else
+        QMutexLocker locker(&mutex);
+        value += n;
+#endif
+    }
+
+    qint64 load() const
+    {
+#if defined(Q_CC_GNU)
+        // a plain read isn't atomic in 32-bit architectures
+        return __sync_fetch_and_add(const_cast<qint64 *>(&value), 0);
+#else
+        QMutexLocker locker(&mutex);
+        return value;
+#endif
+    }
+
+private:
+    qint64 value;
+#if !defined(Q_CC_GNU)
+    mutable QMutex mutex;
+#endif
+};
+
+class Metrics::Histogram
+{
+public:
+    void record(qint64 nsecs)
+    {
+        const qint64 usecs = nsecs / 1000;
+        int i = 0;
+        while (i != BUCKET_COUNT - 1 && usecs > BUCKET_BOUNDS[i])
+            ++i;
+
+        buckets[i].add(1);
+        count.add(1);
+        sum.add(nsecs);
+    }
+
+    QVariantMap toMap() const
+    {
+        QVariantList counts;
+        for (int i = 0;i != BUCKET_COUNT;++i)
+            counts.push_back(buckets[i].load());
+
+        QVariantMap map;
+        map.insert("count", count.load());
+        map.insert("sum", sum.load());
+        map.insert("buckets", counts);
+        return map;
+    }
+
+    void expose(QByteArray &out, const QByteArray &name,
+                const QByteArray &labels) const
+    {
+        const QByteArray separator = labels.isEmpty() ? "" : ",";
+        qint64 cumulative = 0;
+
+        for (int i = 0;i != BUCKET_COUNT;++i) {
+            cumulative += buckets[i].load();
+
+            out.append(name + "_bucket{" + labels + separator + "le=\"");
+            if (i == BUCKET_COUNT - 1)
+                out.append("+Inf");
+            else
+                out.append(QByteArray::number(BUCKET_BOUNDS[i] / 1e6));
+            out.append("\"} " + QByteArray::number(cumulative) + '\n');
+        }
+
+        const QByteArray braces = labels.isEmpty()
+                ? QByteArray() : "{" + labels + "}";
+        out.append(name + "_sum" + braces + ' '
+                   + QByteArray::number(sum.load() / 1e9, 'g', 9) + '\n');
+        out.append(name + "_count" + braces + ' '
+                   + QByteArray::number(count.load()) + '\n');
+    }
+
+private:
+    Counter buckets[BUCKET_COUNT];
+    Counter count;
+    Counter sum;
+};
+
+struct Metrics::MethodStats
+{
+    ~MethodStats()
+    {
+        qDeleteAll(errors);
+    }
+
+    Counter requests;
+    Histogram latency;
+
+    // errors are rare, so a lock is acceptable to find the counter
+    QReadWriteLock errorsLock;
+    QHash<int, Counter *> errors;
+};
+
+namespace {
+
+struct MonotonicClock
+{
+    MonotonicClock()
+    {
+        timer.start();
+    }
+
+    QElapsedTimer timer;
+};
+
+// escapes a label value of the exposition format
+QByteArray escapeLabel(const QString &value)
+{
+    QByteArray escaped = value.toUtf8();
+    escaped.replace('\\', "\\\\");
+    escaped.replace('"', "\\\"");
+    escaped.replace('\n', "\\n");
+    return escaped;
+}
+
+} // namespace
+
+Q_GLOBAL_STATIC(MonotonicClock, monotonicClock)
+
+Metrics::Metrics(QObject *parent) :
+    QObject(parent),
+    others(new MethodStats),
+    parse(new Histogram),
+    bytesReceived(new Counter),
+    bytesSent(new Counter)
+{
+}
+
+Metrics::~Metrics()
+{
+    qDeleteAll(methods);
+    delete others;
+    delete parse;
+    delete bytesReceived;
+    delete bytesSent;
+}
+
+QList<qint64> Metrics::bucketBounds()
+{
+    QList<qint64> bounds;
+    for (int i = 0;i != BUCKET_COUNT - 1;++i)
+        bounds.push_back(BUCKET_BOUNDS[i]);
+    return bounds;
+}
+
+qint64 Metrics::clock()
+{
+    return monotonicClock()->timer.nsecsElapsed();
+}
+
+QVariantMap Metrics::snapshot() const
+{
+    QVariantList bounds;
+    Q_FOREACH (qint64 bound, bucketBounds())
+        bounds.push_back(bound);
+
+    QVariantMap methodMaps;
+    QReadLocker locker(&lock);
+
+    QHash<QString, MethodStats *> all = methods;
+    all.insert(QString(), others);
+
+    for (QHash<QString, MethodStats *>::const_iterator i = all.constBegin();
+         i != all.constEnd();++i) {
+        MethodStats *stats = i.value();
+
+        QVariantMap errors;
+        stats->errorsLock.lockForRead();
+        for (QHash<int, Counter *>::const_iterator j = stats->errors.constBegin();
+             j != stats->errors.constEnd();++j)
+            errors.insert(QString::number(j.key()), j.value()->load());
+        stats->errorsLock.unlock();
+
+        QVariantMap method;
+        method.insert("requests", stats->requests.load());
+        method.insert("errors", errors);
+        method.insert("latency", stats->latency.toMap());
+        methodMaps.insert(i.key(), method);
+    }
+
+    locker.unlock();
+
+    QVariantMap map;
+    map.insert("bounds", bounds);
+    map.insert("methods", methodMaps);
+    map.insert("parse", parse->toMap());
+    map.insert("bytesReceived", bytesReceived->load());
+    map.insert("bytesSent", bytesSent->load());
+    map.insert("handlerPoolHits", ResponseHandler::poolHits());
+    map.insert("handlerPoolMisses", ResponseHandler::poolMisses());
+    return map;
+}
+
+QByteArray Metrics::exposition() const
+{
+    QByteArray requests("# TYPE jsonrpc_requests_total counter\n");
+    QByteArray errors("# TYPE jsonrpc_errors_total counter\n");
+    QByteArray latency("# TYPE jsonrpc_request_duration_seconds histogram\n");
+
+    QReadLocker locker(&lock);
+
+    QHash<QString, MethodStats *> all = methods;
+    all.insert(QString(), others);
+
+    for (QHash<QString, MethodStats *>::const_iterator i = all.constBegin();
+         i != all.constEnd();++i) {
+        MethodStats *stats = i.value();
+        const QByteArray label = "method=\"" + escapeLabel(i.key()) + '"';
+
+        requests.append("jsonrpc_requests_total{" + label + "} "
+                        + QByteArray::number(stats->requests.load()) + '\n');
+
+        stats->errorsLock.lockForRead();
+        for (QHash<int, Counter *>::const_iterator j = stats->errors.constBegin();
+             j != stats->errors.constEnd();++j) {
+            errors.append("jsonrpc_errors_total{" + label + ",code=\""
+                          + QByteArray::number(j.key()) + "\"} "
+                          + QByteArray::number(j.value()->load()) + '\n');
+        }
+        stats->errorsLock.unlock();
+
+        stats->latency.expose(latency, "jsonrpc_request_duration_seconds",
+                              label);
+    }
+
+    locker.unlock();
+
+    QByteArray out = requests + errors + latency;
+
+    out.append("# TYPE jsonrpc_parse_duration_seconds histogram\n");
+    parse->expose(out, "jsonrpc_parse_duration_seconds", QByteArray());
+
+    out.append("# TYPE jsonrpc_received_bytes_total counter\n"
+               "jsonrpc_received_bytes_total ");
+    out.append(QByteArray::number(bytesReceived->load()) + '\n');
+    out.append("# TYPE jsonrpc_sent_bytes_total counter\n"
+               "jsonrpc_sent_bytes_total ");
+    out.append(QByteArray::number(bytesSent->load()) + '\n');
+    out.append("# TYPE jsonrpc_handler_pool_hits_total counter\n"
+               "jsonrpc_handler_pool_hits_total ");
+    out.append(QByteArray::number(ResponseHandler::poolHits()) + '\n');
+    out.append("# TYPE jsonrpc_handler_pool_misses_total counter\n"
+               "jsonrpc_handler_pool_misses_total ");
+    out.append(QByteArray::number(ResponseHandler::poolMisses()) + '\n');
+
+    return out;
+}
+
+Metrics::MethodStats *Metrics::methodStats(const QString &method)
+{
+    if (method.isEmpty())
+        return others;
+
+    {
+        QReadLocker locker(&lock);
+        MethodStats *stats = methods.value(method);
+        if (stats)
+            return stats;
+    }
+
+    QWriteLocker locker(&lock);
+
+    // it can be created by another thread after the read lock is released
+    MethodStats *&stats = methods[method];
+    if (!stats) {
+        if (methods.size() > MAX_METHODS) {
+            methods.remove(method);
+            return others;
+        }
+
+        stats = new MethodStats;
+    }
+    return stats;
+}
+
+void Metrics::recordRequest(MethodStats *stats)
+{
+    stats->requests.add(1);
+}
+
+void Metrics::recordResponse(MethodStats *stats, qint64 nsecs)
+{
+    stats->latency.record(nsecs);
+}
+
+void Metrics::recordError(MethodStats *stats, int code, qint64 nsecs)
+{
+    if (!stats)
+        stats = others;
+
+    if (nsecs >= 0)
+        stats->latency.record(nsecs);
+
+    stats->errorsLock.lockForRead();
+    Counter *counter = stats->errors.value(code);
+    stats->errorsLock.unlock();
+
+    if (!counter) {
+        QWriteLocker locker(&stats->errorsLock);
+        Counter *&slot = stats->errors[code];
+        if (!slot)
+            slot = new Counter;
+        counter = slot;
+    }
+
+    counter->add(1);
+}
+
+void Metrics::recordParse(qint64 nsecs)
+{
+    parse->record(nsecs);
+}
+
+void Metrics::addBytesReceived(qint64 bytes)
+{
+    bytesReceived->add(bytes);
+}
+
+void Metrics::addBytesSent(qint64 bytes)
+{
+    bytesSent->add(bytes);
+}
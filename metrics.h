@@ -0,0 +1,113 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_METRICS_H
+#define QTJSONRPC_METRICS_H
+
+#include <QObject>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QVariant>
+
+namespace JsonRPC {
+
+/*!
+  Counters and latency histograms of the requests handled by the peers
+  that use this object (see Peer::setMetrics). A Metrics object can be
+  shared by several peers and threads, like a MethodRegistry.
+
+  For each method it records the number of requests, the number of error
+  responses of each error code and a histogram of the time from the
+  moment the message is received by Peer::handleMessage until the
+  response is serialized. It also records the time spent parsing the
+  messages and the bytes of the received and sent messages.
+  Errors answered to messages that aren't valid requests are recorded
+  under the method "".
+
+  The counters are updated with atomic operations and the histograms
+  have fixed buckets. Each peer resolves the stats of a method once, so
+  only the first request of a method in a peer takes a read lock (and
+  the first one in the Metrics object a write lock). Each error response
+  takes a read lock of the errors of its method, and the first error of
+  a code a write lock. After MAX_METHODS methods, the requests of new
+  methods are recorded under the method "", so a client can't make the
+  metrics grow without bound.
+  */
+class Metrics : public QObject
+{
+    Q_OBJECT
+public:
+    enum
+    {
+        /*! Number of methods recorded by name. */
+        MAX_METHODS = 1000
+    };
+
+    explicit Metrics(QObject *parent = 0);
+    ~Metrics();
+
+    /*!
+      @return the upper bounds of the histogram buckets, in microseconds.
+      The last bucket, not included, has no upper bound.
+      */
+    static QList<qint64> bucketBounds();
+
+    /*!
+      @return a copy of the current values:
+      - "bounds": the result of bucketBounds
+      - "methods": a map from the method names to maps with the
+        "requests" count, the "errors" count of each code (a map from the
+        code, as a string, to the count) and the "latency" histogram
+      - "parse": the histogram of the parsing time
+      - "bytesReceived" and "bytesSent"
+      - "handlerPoolHits" and "handlerPoolMisses": the process-wide
+        counters of ResponseHandler::poolHits and poolMisses
+
+      The histograms are maps with the "count" of samples, their "sum" in
+      nanoseconds and the number of samples in each of the "buckets" (not
+      cumulative).
+      The values are read one by one, so they can be slightly
+      inconsistent if requests are being handled.
+      */
+    QVariantMap snapshot() const;
+    /*!
+      @return the current values in the Prometheus text exposition
+      format, with the durations in seconds.
+      */
+    QByteArray exposition() const;
+
+    /*!
+      @return a monotonic clock, in nanoseconds, used to measure the
+      durations.
+      */
+    static qint64 clock();
+
+private:
+    friend class Peer;
+    friend class ResponseHandler;
+
+    struct MethodStats;
+    class Histogram;
+
+    MethodStats *methodStats(const QString &method);
+    void recordRequest(MethodStats *stats);
+    void recordResponse(MethodStats *stats, qint64 nsecs);
+    void recordError(MethodStats *stats, int code, qint64 nsecs);
+    void recordParse(qint64 nsecs);
+    void addBytesReceived(qint64 bytes);
+    void addBytesSent(qint64 bytes);
+
+    mutable QReadWriteLock lock;
+    QHash<QString, MethodStats *> methods;
+    // requests of unnamed and unknown methods
+    MethodStats *others;
+
+    Histogram *parse;
+
+    class Counter;
+    Counter *bytesReceived;
+    Counter *bytesSent;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_METRICS_H
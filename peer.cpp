@@ -2,8 +2,17 @@
 
 #include "peer.h"
 #include "responsehandler.h"
+#include "jsonparser.h"
+#include "cbor.h"
+#include "responsebatch.h"
+#include "methodregistry.h"
+#include "responsewriter.h"
+#include "rawvalue.h"
+#include "metrics.h"
 
 #include <QVariantMap>
+#include <QThread>
+#include <QtAlgorithms>
 
 #include <qt-json/json.h>
 
@@ -18,14 +27,36 @@ inline bool isRequestMessage(const QVariantMap &object)
         return false;
 }
 
-inline bool isRequestMessage(const QVariantList &objectList)
+inline bool isResponseMessage(const QVariantMap &object)
 {
-    if (objectList.size())
+    if (object.contains("result")
+            || object.contains("error"))
         return true;
     else
         return false;
 }
 
+inline bool isRequestMessage(const QVariantList &objectList)
+{
+    // a batch is handled as a request batch unless all of its elements
+    // are response objects
+    Q_FOREACH (const QVariant &object, objectList) {
+        if (object.type() != QVariant::Map
+                || !isResponseMessage(object.toMap()))
+            return true;
+    }
+
+    return false;
+}
+
+inline bool isValidCall(const QString &method, const QVariant &params)
+{
+    return !method.startsWith("rpc.")
+            && (params.type() == QVariant::List
+                || params.type() == QVariant::Map
+                || params.isNull());
+}
+
 inline bool isRequestMessage(const QVariant &object)
 {
     switch (object.type()) {
@@ -38,15 +69,6 @@ inline bool isRequestMessage(const QVariant &object)
     }
 }
 
-inline bool isResponseMessage(const QVariantMap &object)
-{
-    if (object.contains("result")
-            || object.contains("error"))
-        return true;
-    else
-        return false;
-}
-
 inline bool isResponseMessage(const QVariantList &objectList)
 {
     if (objectList.size())
@@ -67,88 +89,469 @@ inline bool isResponseMessage(const QVariant &object)
     }
 }
 
+inline QByteArray methodName(const char *member)
+{
+    // skips the code added by the SLOT and SIGNAL macros
+    if (*member >= '0' && *member <= '2')
+        ++member;
+
+    QByteArray name(member);
+    const int paren = name.indexOf('(');
+    if (paren != -1)
+        name.truncate(paren);
+
+    return name;
+}
+
+inline bool toCallId(const QVariant &id, qint64 &callId)
+{
+    switch (id.type()) {
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+        callId = id.toLongLong();
+        return true;
+    case QVariant::Double:
+        callId = id.toLongLong();
+        return double(callId) == id.toDouble();
+    default:
+        return false;
+    }
+}
+
 Peer::Peer(QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    link(new Link),
+    m_parserBackend(UTF8_PARSER),
+    m_encoding(JSON_ENCODING),
+    m_lazyParams(true),
+    inFlightRequests(0),
+    messageTime(0),
+    m_bytesReceived(0),
+    m_bytesSent(0),
+    lastCallId(0),
+    m_callCoalescing(false)
+{
+    link->peer = this;
+}
+
+Peer::~Peer()
+{
+    // waits for any reply being posted from other threads
+    QMutexLocker locker(&link->mutex);
+    link->peer = NULL;
+}
+
+Peer::ParserBackend Peer::parserBackend() const
+{
+    return m_parserBackend;
+}
+
+void Peer::setParserBackend(ParserBackend backend)
+{
+    m_parserBackend = backend;
+}
+
+Peer::Encoding Peer::encoding() const
+{
+    return m_encoding;
+}
+
+void Peer::setEncoding(Encoding encoding)
+{
+    m_encoding = encoding;
+}
+
+bool Peer::lazyParams() const
+{
+    return m_lazyParams;
+}
+
+void Peer::setLazyParams(bool enabled)
+{
+    m_lazyParams = enabled;
+}
+
+int Peer::pendingCallCount() const
+{
+    return pendingCalls.size();
+}
+
+bool Peer::callCoalescing() const
+{
+    return m_callCoalescing;
+}
+
+void Peer::setCallCoalescing(bool enabled)
+{
+    m_callCoalescing = enabled;
+
+    if (!enabled)
+        coalescedCalls.clear();
+}
+
+void Peer::resetCallCoalescing()
+{
+    coalescedCalls.clear();
+}
+
+bool Peer::failPendingCall(const QVariant &id, int code,
+                           const QString &message, const QVariant &data)
+{
+    PendingCall pendingCall;
+    if (!takePendingCall(id, pendingCall))
+        return false;
+
+    failCall(pendingCall, code, message, data, id);
+    return true;
+}
+
+void Peer::failPendingCalls(int code, const QString &message,
+                            const QVariant &data)
+{
+    // the calls made by the callbacks aren't failed
+    QList<qint64> ids = pendingCalls.keys();
+    qSort(ids);
+
+    Q_FOREACH (qint64 callId, ids) {
+        // the followers are failed with their leaders
+        PendingCall pendingCall;
+        if (takePendingCall(callId, pendingCall))
+            failCall(pendingCall, code, message, data, QVariant(callId));
+    }
+}
+
+int Peer::inFlightRequestCount() const
+{
+    return inFlightRequests;
+}
+
+MethodRegistry *Peer::methodRegistry() const
+{
+    return m_methodRegistry;
+}
+
+void Peer::setMethodRegistry(MethodRegistry *registry)
+{
+    m_methodRegistry = registry;
+}
+
+Metrics *Peer::metrics() const
+{
+    return m_metrics;
+}
+
+void Peer::setMetrics(Metrics *metrics)
+{
+    m_metrics = metrics;
+    m_methodStats.clear();
+}
+
+qint64 Peer::bytesReceived() const
+{
+    return m_bytesReceived;
+}
+
+qint64 Peer::bytesSent() const
+{
+    return m_bytesSent;
+}
+
+bool Peer::registerMethod(const QString &name, QObject *receiver,
+                          const char *member,
+                          MethodRegistry::ExecutionMode mode)
+{
+    return ensureMethodRegistry()->registerMethod(name, receiver, member,
+                                                  mode);
+}
+
+bool Peer::registerMethod(const QString &name, AbstractMethod *method,
+                          MethodRegistry::ExecutionMode mode)
+{
+    return ensureMethodRegistry()->registerMethod(name, method, mode);
+}
+
+MethodRegistry *Peer::ensureMethodRegistry()
+{
+    if (!m_methodRegistry)
+        m_methodRegistry = new MethodRegistry(this);
+
+    return m_methodRegistry;
+}
+
+void Peer::unregisterMethod(const QString &name)
+{
+    if (m_methodRegistry)
+        m_methodRegistry->unregisterMethod(name);
+}
+
+QByteArray Peer::serialize(const QVariant &json, Encoding encoding)
 {
+    if (encoding == CBOR_ENCODING)
+        return Cbor::serialize(json);
+    else
+        return QtJson::Json::serialize(json);
+}
+
+QVariant Peer::parse(const QByteArray &json, bool &ok, int options) const
+{
+    if (m_parserBackend == UTF8_PARSER)
+        return JsonParser::parse(json, ok, options);
+    else
+        return QtJson::Json::parse(QString::fromUtf8(json), ok);
 }
 
 void Peer::handleMessage(const QByteArray &json)
 {
+    handleMessage(json, JSON_ENCODING);
+}
+
+void Peer::handleMessage(const QByteArray &message, Encoding encoding)
+{
+    // JsonParser::RAW_PARAMS and Cbor::RAW_PARAMS have the same value
+    const int options = m_lazyParams ? int(JsonParser::RAW_PARAMS)
+                                     : int(JsonParser::NO_OPTIONS);
+
+    m_bytesReceived += message.size();
+
+    // the latency of the requests is measured from here
+    const qint64 receivedAt = m_metrics ? Metrics::clock() : 0;
+
     bool ok;
-    QVariant object = QtJson::Json::parse(QString::fromUtf8(json), ok);
+    QVariant object = (encoding == CBOR_ENCODING)
+            ? Cbor::parse(message, ok, options)
+            : parse(message, ok, options);
+
+    if (m_metrics) {
+        m_metrics->recordParse(Metrics::clock() - receivedAt);
+        m_metrics->addBytesReceived(message.size());
+    }
 
     if (!ok) {
-        emit readyResponseMessage(static_cast<QByteArray>(Error(PARSE_ERROR)));
+        replyError(Error(PARSE_ERROR), QSharedPointer<ResponseBatch>());
         return;
     }
 
+    messageTime = receivedAt;
+
     if (isRequestMessage(object))
         handleRequest(object);
     else if (isResponseMessage(object))
         handleResponse(object);
     else
-        emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
+        replyError(Error(INVALID_REQUEST), QSharedPointer<ResponseBatch>());
+
+    messageTime = 0;
 }
 
 void Peer::handleRequest(const QVariant &json)
 {
-    if (json.type() != QVariant::Map) {
-        emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
+    if (json.type() == QVariant::List) {
+        const QVariantList requests = json.toList();
+
+        if (requests.isEmpty()) {
+            replyError(Error(INVALID_REQUEST), QSharedPointer<ResponseBatch>());
+            return;
+        }
+
+        QSharedPointer<ResponseBatch> batch(new ResponseBatch(this));
+
+        Q_FOREACH (const QVariant &request, requests)
+            handleRequest(request, batch);
+
+        batch->seal();
         return;
     }
 
-    QVariantMap object = json.toMap();
+    handleRequest(json, QSharedPointer<ResponseBatch>());
+}
 
-    if (!object.contains("method")) {
-        emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
+void Peer::handleRequest(const QVariant &json,
+                         const QSharedPointer<ResponseBatch> &batch)
+{
+    if (json.type() != QVariant::Map) {
+        replyError(Error(INVALID_REQUEST), batch);
         return;
     }
 
-    QVariant method = object["method"];
-    QSharedPointer<JsonRPC::ResponseHandler> handler(new ResponseHandler(this));
+    const QVariantMap object = json.toMap();
+
+    // requests without id are notifications, they're never answered, so
+    // no handler is allocated for them
+    const QVariantMap::const_iterator id = object.constFind("id");
+    if (id == object.constEnd()) {
+        ResponseHandler request;
 
-    if (method.type() == QVariant::String) {
-        if (!handler->setMethod(method.toString())) {
-            emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
+        if (!readRequest(object, request)) {
+            replyError(Error(INVALID_REQUEST), batch);
             return;
         }
-    } else {
-        emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
+
+        if (m_metrics)
+            m_metrics->recordRequest(methodStats(request.method()));
+
+        dispatchNotification(request);
         return;
     }
 
-    if (object.contains("params")) {
-        QVariant params = object["params"];
+    QSharedPointer<JsonRPC::ResponseHandler> handler(new ResponseHandler(this));
 
-        if (!handler->setParams(params)) {
-            emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
-            return;
-        }
+    if (!readRequest(object, *handler) || !handler->setId(id.value())) {
+        replyError(Error(INVALID_REQUEST), batch);
+        return;
     }
 
-    if (object.contains("id")) {
-        QVariant id = object["id"];
+    if (m_metrics) {
+        handler->metrics = m_metrics;
+        handler->methodStats = methodStats(handler->method());
+        handler->receivedAt = messageTime ? messageTime : Metrics::clock();
+        m_metrics->recordRequest(handler->methodStats);
+    }
 
-        if (!handler->setId(id)) {
-            emit readyResponseMessage(static_cast<QByteArray>(Error(INVALID_REQUEST)));
-            return;
-        }
+    ++inFlightRequests;
+
+    if (batch)
+        handler->setBatch(batch);
+    else
+        handler->counted = true;
+
+    dispatch(handler);
+}
+
+bool Peer::readRequest(const QVariantMap &object, ResponseHandler &handler)
+{
+    const QVariant method = object.value("method");
+
+    if (method.type() != QVariant::String
+            || !handler.setMethod(method.toString()))
+        return false;
+
+    QVariantMap::const_iterator i = object.constFind("params");
+    if (i == object.constEnd())
+        return true;
+
+    const QVariant &params = i.value();
+    return (params.userType() == qMetaTypeId<RawValue>())
+            ? handler.setRawParams(params.value<RawValue>())
+            : handler.setParams(params);
+}
+
+void Peer::dispatchNotification(const ResponseHandler &request)
+{
+    if (m_methodRegistry && m_methodRegistry->notify(request))
+        return;
+
+    if (receivers(SIGNAL(readyNotification(QString,QVariant)))) {
+        emit readyNotification(request.method(), request.params());
+        return;
+    }
+
+    // the handlers of readyRequest used to receive the notifications too
+    if (receivers(SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>))))
+        emit readyRequest(request.copy());
+}
+
+Metrics::MethodStats *Peer::methodStats(const QString &method)
+{
+    QHash<QString, Metrics::MethodStats *>::const_iterator i
+            = m_methodStats.constFind(method);
+    if (i != m_methodStats.constEnd())
+        return i.value();
+
+    Metrics::MethodStats *stats = m_metrics->methodStats(method);
+
+    // limited like the methods of the metrics, so a client can't make
+    // this hash grow without bound
+    if (m_methodStats.size() < Metrics::MAX_METHODS)
+        m_methodStats.insert(method, stats);
+
+    return stats;
+}
+
+void Peer::dispatch(const QSharedPointer<ResponseHandler> &handler)
+{
+    if (m_methodRegistry && m_methodRegistry->invoke(handler))
+        return;
+
+    if (receivers(SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>))))
+        emit readyRequest(handler);
+    else
+        handler->error(Error(METHOD_NOT_FOUND));
+}
+
+void Peer::replyError(const Error &error,
+                      const QSharedPointer<ResponseBatch> &batch)
+{
+    if (m_metrics)
+        m_metrics->recordError(NULL, error.code, -1);
+
+    if (batch) {
+        batch->addError(ResponseWriter::error(error, QVariant(),
+                                              batch->encoding()));
+    } else {
+        const QByteArray message = ResponseWriter::error(error, QVariant(),
+                                                         m_encoding);
+        countSent(message);
+        emit readyResponseMessage(message);
     }
+}
+
+void Peer::countSent(const QByteArray &message)
+{
+    m_bytesSent += message.size();
 
-    emit readyRequest(handler);
+    if (m_metrics)
+        m_metrics->addBytesSent(message.size());
 }
 
 void Peer::reply(const QVariant &json)
 {
-    emit readyResponseMessage(QtJson::Json::serialize(json));
+    const QByteArray message = serialize(json, m_encoding);
+    countSent(message);
+    emit readyResponseMessage(message);
+}
+
+void Peer::sendResponseMessage(const QByteArray &json, int requests)
+{
+    if (!json.isEmpty()) {
+        countSent(json);
+        emit readyResponseMessage(json);
+    }
+
+    if (requests) {
+        inFlightRequests -= requests;
+        emit requestsFinished(inFlightRequests);
+    }
+}
+
+void Peer::postReply(const QSharedPointer<Link> &link,
+                     const QByteArray &message, int requests)
+{
+    QMutexLocker locker(&link->mutex);
+
+    if (!link->peer)
+        return;
+
+    if (link->peer->thread() == QThread::currentThread()) {
+        // the peer can only be destroyed by this thread
+        Peer *peer = link->peer;
+        locker.unlock();
+        peer->sendResponseMessage(message, requests);
+        return;
+    }
+
+    // the serialization was done by the calling thread, only the
+    // delivery happens in the thread of the peer
+    QMetaObject::invokeMethod(link->peer, "sendResponseMessage",
+                              Qt::QueuedConnection,
+                              Q_ARG(QByteArray, message),
+                              Q_ARG(int, requests));
 }
 
 bool Peer::call(const QString &method, const QVariant &params, const QVariant &id)
 {
-    if (method.startsWith("rpc.")
-            || (params.type() != QVariant::List
-                && params.type() != QVariant::Map
-                && !params.isNull())
+    if (!isValidCall(method, params)
             || (id.type() != QVariant::String
                 && id.type() != QVariant::Int
                 && id.type() != QVariant::ULongLong
@@ -168,49 +571,226 @@ bool Peer::call(const QString &method, const QVariant &params, const QVariant &i
 
     object.insert("id", id);
 
-    emit readyRequestMessage(QtJson::Json::serialize(object));
+    const QByteArray message = serialize(object, m_encoding);
+    countSent(message);
+    emit readyRequestMessage(message);
+    return true;
+}
+
+bool Peer::notify(const QString &method, const QVariant &params)
+{
+    if (!isValidCall(method, params))
+        return false;
+
+    QVariantMap object;
+
+    object.insert("jsonrpc", "2.0");
+
+    object.insert("method", method);
+
+    if (!params.isNull())
+        object.insert("params", params);
+
+    const QByteArray message = serialize(object, m_encoding);
+    countSent(message);
+    emit readyRequestMessage(message);
+    return true;
+}
+
+QVariant Peer::call(const QString &method, const QVariant &params,
+                    QObject *receiver, const char *returnMethod,
+                    const char *errorMethod)
+{
+    if (!receiver || !returnMethod || !isValidCall(method, params))
+        return QVariant();
+
+    QByteArray key;
+    qint64 leaderId = 0;
+
+    if (m_callCoalescing) {
+        // the params are serialized from a QMap, so the members of a map
+        // are always in the same order
+        key = method.toUtf8();
+        key.append('\0');
+        key.append(serialize(params, JSON_ENCODING));
+        leaderId = coalescedCalls.value(key);
+    }
+
+    const qint64 callId = ++lastCallId;
+    const QVariant id(callId);
+
+    // the call is pending before the request is sent, a peer connected
+    // directly can answer it before this function returns
+    PendingCall pendingCall;
+    pendingCall.receiver = receiver;
+    pendingCall.returnMethod = methodName(returnMethod);
+    if (errorMethod)
+        pendingCall.errorMethod = methodName(errorMethod);
+
+    if (leaderId) {
+        // nothing is sent, the call waits for the response of the
+        // identical one
+        pendingCalls.insert(callId, pendingCall);
+        pendingCalls[leaderId].followers.push_back(callId);
+        return id;
+    }
+
+    if (m_callCoalescing) {
+        pendingCall.coalescingKey = key;
+        coalescedCalls.insert(key, callId);
+    }
+    pendingCalls.insert(callId, pendingCall);
+
+    if (!call(method, params, id)) {
+        takePendingCall(callId, pendingCall);
+        return QVariant();
+    }
+
+    return id;
+}
+
+bool Peer::takePendingCall(const QVariant &id, PendingCall &call)
+{
+    qint64 callId;
+    if (pendingCalls.isEmpty() || !toCallId(id, callId))
+        return false;
+
+    return takePendingCall(callId, call);
+}
+
+bool Peer::takePendingCall(qint64 callId, PendingCall &call)
+{
+    QHash<qint64, PendingCall>::iterator i = pendingCalls.find(callId);
+    if (i == pendingCalls.end())
+        return false;
+
+    call = i.value();
+    pendingCalls.erase(i);
+
+    // after resetCallCoalescing, the key can belong to a newer call
+    if (!call.coalescingKey.isEmpty()) {
+        QHash<QByteArray, qint64>::iterator j
+                = coalescedCalls.find(call.coalescingKey);
+        if (j != coalescedCalls.end() && j.value() == callId)
+            coalescedCalls.erase(j);
+    }
+
+    return true;
+}
+
+void Peer::deliverResult(const PendingCall &call, const QVariant &result,
+                         const QVariant &id)
+{
+    if (call.receiver) {
+        QMetaObject::invokeMethod(call.receiver, call.returnMethod.constData(),
+                                  Q_ARG(QVariant, result),
+                                  Q_ARG(QVariant, id));
+    }
+}
+
+bool Peer::deliverError(const PendingCall &call, int code,
+                        const QString &message, const QVariant &data,
+                        const QVariant &id)
+{
+    if (call.errorMethod.isEmpty())
+        return false;
+
+    if (call.receiver) {
+        QMetaObject::invokeMethod(call.receiver, call.errorMethod.constData(),
+                                  Q_ARG(int, code),
+                                  Q_ARG(QString, message),
+                                  Q_ARG(QVariant, data),
+                                  Q_ARG(QVariant, id));
+    }
     return true;
 }
 
 void Peer::handleResponse(const QVariant &json)
 {
-    QVariantList objects;
     if (json.type() == QVariant::Map) {
-        objects.push_back(json);
+        handleResponseObject(json.toMap());
     } else if (json.type() == QVariant::List) {
-        objects = json.toList();
-    } else {
-        return;
+        // the elements are read in place, the list isn't rebuilt
+        const QVariantList objects = json.toList();
+        for (QVariantList::const_iterator i = objects.constBegin();
+             i != objects.constEnd();++i) {
+            if (i->type() == QVariant::Map)
+                handleResponseObject(i->toMap());
+        }
     }
+}
 
-    Q_FOREACH (const QVariant &object, objects) {
-        if (object.type() == QVariant::Map) {
-            QVariantMap objectMap = object.toMap();
-
-            if (objectMap.contains("result")) {
-                emit readyResponse(objectMap.value("result"),
-                                   objectMap.value("id"));
-            } else if (objectMap.contains("error")
-                       && objectMap.value("error").type() == QVariant::Map) {
-                QVariantMap errorObject = objectMap["error"].toMap();
-
-                if (!errorObject.contains("code")
-                        || (errorObject.value("code").type() != QVariant::Int
-                            && errorObject.value("code").type() != QVariant::ULongLong
-                            && errorObject.value("code").type() != QVariant::LongLong)
-                        || !errorObject.contains("message")
-                        || errorObject.value("message").type() != QVariant::String)
-                    continue;
-
-                int code = errorObject["code"].toInt();
-                QString message = errorObject["message"].toString();
-                QVariant data = errorObject.contains("data") ? errorObject["data"]
-                                                             : QVariant();
-                QVariant id = objectMap.contains("id") ? objectMap["id"]
-                                                       : QVariant();
-
-                emit requestError(code, message, data, id);
+void Peer::handleResponseObject(const QVariantMap &object)
+{
+    // only const lookups are made, so the map is never detached
+    QVariantMap::const_iterator i = object.constFind("id");
+    const QVariant id = (i != object.constEnd()) ? i.value() : QVariant();
+
+    i = object.constFind("result");
+    if (i != object.constEnd()) {
+        PendingCall pendingCall;
+
+        if (takePendingCall(id, pendingCall)) {
+            deliverResult(pendingCall, i.value(), id);
+
+            // the coalesced calls get the same result, with their ids
+            Q_FOREACH (qint64 followerId, pendingCall.followers) {
+                PendingCall follower;
+                if (takePendingCall(followerId, follower))
+                    deliverResult(follower, i.value(), QVariant(followerId));
             }
+            return;
         }
+
+        emit readyResponse(i.value(), id);
+        return;
+    }
+
+    i = object.constFind("error");
+    if (i == object.constEnd() || i.value().type() != QVariant::Map)
+        return;
+
+    const QVariantMap errorObject = i.value().toMap();
+    const QVariantMap::const_iterator code = errorObject.constFind("code");
+    const QVariantMap::const_iterator message
+            = errorObject.constFind("message");
+
+    if (code == errorObject.constEnd()
+            || (code.value().type() != QVariant::Int
+                && code.value().type() != QVariant::ULongLong
+                && code.value().type() != QVariant::LongLong)
+            || message == errorObject.constEnd()
+            || message.value().type() != QVariant::String)
+        return;
+
+    const int errorCode = code.value().toInt();
+    const QString errorMessage = message.value().toString();
+    const QVariant data = errorObject.value("data");
+    PendingCall pendingCall;
+
+    if (!takePendingCall(id, pendingCall)) {
+        emit requestError(errorCode, errorMessage, data, id);
+        return;
+    }
+
+    failCall(pendingCall, errorCode, errorMessage, data, id);
+}
+
+// call was already taken from the pending calls
+void Peer::failCall(const PendingCall &call, int code, const QString &message,
+                    const QVariant &data, const QVariant &id)
+{
+    if (!deliverError(call, code, message, data, id))
+        emit requestError(code, message, data, id);
+
+    // the coalesced calls get the same error, with their ids
+    Q_FOREACH (qint64 followerId, call.followers) {
+        PendingCall follower;
+        if (!takePendingCall(followerId, follower))
+            continue;
+
+        const QVariant followerCallId(followerId);
+        if (!deliverError(follower, code, message, data, followerCallId))
+            emit requestError(code, message, data, followerCallId);
     }
 }
@@ -6,10 +6,18 @@
 #include <QObject>
 #include <QVariant>
 #include <QSharedPointer>
+#include <QPointer>
+#include <QHash>
+#include <QMutex>
+
+#include "methodregistry.h"
+#include "metrics.h"
 
 namespace JsonRPC {
 
 class ResponseHandler;
+class ResponseBatch;
+struct Error;
 
 /*!
   JSON-RPC 2.0 handler (server and client)
@@ -18,18 +26,222 @@ class Peer: public QObject
 {
     Q_OBJECT
 public:
+    /*!
+      The parser used to decode incoming messages.
+      */
+    enum ParserBackend
+    {
+        /*! Decodes the message into a QString and uses the qt-json
+          library to parse it.
+          */
+        QTJSON_PARSER,
+        /*! Parses the UTF-8 message directly, without a QString copy
+          of the whole message.
+          @sa JsonParser
+          */
+        UTF8_PARSER
+    };
+
+    /*!
+      The encoding of the messages.
+      */
+    enum Encoding
+    {
+        /*! UTF-8 encoded JSON text.
+          */
+        JSON_ENCODING,
+        /*! CBOR encoded JSON object model. It's only understood by
+          peers that support it, so it must be negotiated by the
+          transport.
+          @sa Cbor
+          */
+        CBOR_ENCODING
+    };
+
     /*!
       Constructs an object with parent object \param parent.
       */
     Peer(QObject *parent = NULL);
+    ~Peer();
+
+    /*!
+      @return the parser used by handleMessage.
+      */
+    ParserBackend parserBackend() const;
+    /*!
+      Sets the parser used by handleMessage to \param backend.
+      The default is UTF8_PARSER.
+      */
+    void setParserBackend(ParserBackend backend);
+
+    /*!
+      @return the encoding of the messages emitted by this peer.
+      */
+    Encoding encoding() const;
+    /*!
+      Sets the encoding of the messages emitted by this peer to
+      \param encoding. The default is JSON_ENCODING.
+      Incoming messages are decoded according to the encoding passed to
+      handleMessage, independently of this setting.
+      */
+    void setEncoding(Encoding encoding);
+
+    /*!
+      @return true if the params of the requests are decoded only when
+      the ResponseHandler needs them.
+      */
+    bool lazyParams() const;
+    /*!
+      When enabled (the default), the params of the requests are only
+      validated by handleMessage and kept as a copy of their bytes in the
+      ResponseHandler, that decodes them when they're accessed. So
+      routing and rejecting requests doesn't decode their params.
+      It has no effect with the QTJSON_PARSER backend.
+      @sa ResponseHandler::params ResponseHandler::param
+      */
+    void setLazyParams(bool enabled);
+
+    /*!
+      @return the number of calls made with a completion callback that
+      are still waiting for a response.
+      @sa call
+      */
+    int pendingCallCount() const;
+
+    /*!
+      @return true if identical calls are coalesced.
+      @sa setCallCoalescing
+      */
+    bool callCoalescing() const;
+    /*!
+      When enabled, a call made with a completion callback while an
+      identical one (same method and params) is still waiting for its
+      response isn't sent: it waits for the response of the first one,
+      that is delivered to every caller, each one with its own id.
+      It's disabled by default, because the results are shared, so it
+      should only be used with methods without side effects.
+      @sa resetCallCoalescing
+      */
+    void setCallCoalescing(bool enabled);
+    /*!
+      Stops attaching new calls to the calls already sent, so the next
+      calls are sent even if an identical one is pending. Use it when the
+      transport may have lost requests, otherwise a lost call would hold
+      every identical call made after it.
+      @sa failPendingCall
+      */
+    void resetCallCoalescing();
+    /*!
+      Answers the pending call \param id, and the calls coalesced with
+      it, with an error, as if it was received from the other side. Use
+      it when the transport knows that the request was lost, so the call
+      isn't left waiting forever.
+      @return false if \param id isn't a pending call.
+      */
+    bool failPendingCall(const QVariant &id, int code, const QString &message,
+                         const QVariant &data = QVariant());
+    /*!
+      Answers every pending call with an error, as failPendingCall does.
+      Use it when the connection is lost.
+      */
+    void failPendingCalls(int code, const QString &message,
+                          const QVariant &data = QVariant());
+
+    /*!
+      @return the number of received requests (with an id) that weren't
+      answered yet.
+      @sa requestsFinished
+      */
+    int inFlightRequestCount() const;
+
+    /*!
+      @return the object where the requests are recorded, or NULL if
+      none.
+      */
+    Metrics *metrics() const;
+    /*!
+      Sets the object where the requests handled by this peer are
+      recorded to \param metrics. The peer doesn't take the ownership of
+      \param metrics, so it can be shared by several peers.
+      The default is NULL (no metrics).
+      */
+    void setMetrics(Metrics *metrics);
+
+    /*!
+      @return the number of bytes of the messages passed to
+      handleMessage.
+      */
+    qint64 bytesReceived() const;
+    /*!
+      @return the number of bytes of the messages emitted by this peer.
+      */
+    qint64 bytesSent() const;
+
+    /*!
+      @return the registry used to dispatch requests, or NULL if none.
+      */
+    MethodRegistry *methodRegistry() const;
+    /*!
+      Sets the registry used to dispatch requests to \param registry.
+      The peer doesn't take the ownership of \param registry, so it can be
+      shared by several peers.
+      Requests for methods that are not in the registry are emitted
+      through the readyRequest signal. If nothing is connected to this
+      signal, they are answered with a METHOD_NOT_FOUND error.
+      */
+    void setMethodRegistry(MethodRegistry *registry);
+    /*!
+      Registers the method \param name in the registry of this peer,
+      creating one if necessary.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, QObject *receiver,
+                        const char *member,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the method \param name in the registry of this peer,
+      creating one if necessary.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, AbstractMethod *method,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the function \param function as the method \param name
+      in the registry of this peer, creating one if necessary.
+      @sa MethodRegistry::registerFunction
+      */
+    template<typename Function>
+    bool registerFunction(const QString &name, Function function,
+                          const QStringList &names = QStringList(),
+                          MethodRegistry::ExecutionMode mode
+                          = MethodRegistry::DIRECT_EXECUTION)
+    {
+        return ensureMethodRegistry()->registerFunction(name, function, names, mode);
+    }
+    /*!
+      Removes the method \param name from the registry of this peer.
+      */
+    void unregisterMethod(const QString &name);
 
 signals:
     /*!
-      Emitted when a new request message is available.
+      Emitted when a new request message is available and its method
+      isn't in the method registry.
       /param handler is the object that you use to send a response.
-      @sa handleMessage
+      @sa handleMessage setMethodRegistry
       */
     void readyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+    /*!
+      Emitted when a new notification (a request without id) is
+      available and its method isn't in the method registry.
+      \param method and \param params are the ones of the notification.
+      No ResponseHandler is allocated for it. If nothing is connected to
+      this signal, the notification is emitted through readyRequest.
+      @sa MethodRegistry::notify
+      */
+    void readyNotification(QString method, QVariant params);
     /*!
       Emitted when the message for your call is available.
       \param json is the message that you need to send to the other
@@ -60,6 +272,15 @@ signals:
       */
     void requestError(int code, QString message, QVariant data, QVariant id);
 
+    /*!
+      Emitted when received requests are answered, or their
+      ResponseHandler is destroyed without answering them.
+      \param inFlightCount is the number of requests still waiting for a
+      response.
+      @sa inFlightRequestCount
+      */
+    void requestsFinished(int inFlightCount);
+
 public slots:
     /*!
       It parses \param json and emit the signals to correctly handle the
@@ -67,8 +288,17 @@ public slots:
       Use this method every time that you have a new message to handle.
       */
     void handleMessage(const QByteArray &json);
+    /*!
+      It decodes \param message, encoded as \param encoding, and emit
+      the signals to correctly handle the message.
+      @sa handleMessage
+      */
+    void handleMessage(const QByteArray &message, Encoding encoding);
     /*!
       It handles a request message.
+      If \param json is a batch (a list of requests), the responses are
+      collected and emitted as a single readyResponseMessage, after the
+      last request of the batch is answered.
       @sa handleMessage
       */
     void handleRequest(const QVariant &json);
@@ -81,7 +311,9 @@ public slots:
     /*!
       Use this method to emit the readyResponseMessage signal.
       You probably don't want to use this.
-      It's used by the ResponseHandler class.
+      ResponseHandler writes its responses directly, without building
+      the response object.
+      @warning this method must be called from the thread of the peer.
       */
     void reply(const QVariant &json);
 
@@ -91,6 +323,110 @@ public slots:
       according JSON-RPC 2.0 spec.
       */
     bool call(const QString &method, const QVariant &params, const QVariant &id);
+    /*!
+      Prepares a request message using an id generated by the peer.
+      The response is delivered only to \param receiver: \param returnMethod
+      is invoked with the same arguments of the readyResponse signal and
+      \param errorMethod with the same arguments of the requestError
+      signal. If \param errorMethod is NULL, the requestError signal is
+      emitted instead.
+      The generated ids are increasing positive integers, so you shouldn't
+      use integer ids in the other overload of this method.
+      @return the generated id, or a null QVariant if \param method and
+      \param params are not valid, according JSON-RPC 2.0 spec.
+      */
+    QVariant call(const QString &method, const QVariant &params,
+                  QObject *receiver, const char *returnMethod,
+                  const char *errorMethod = 0);
+    /*!
+      Prepares a notification message, a request without id that is
+      never answered.
+      @return true if \param method and \param params are valid,
+      according JSON-RPC 2.0 spec.
+      */
+    bool notify(const QString &method, const QVariant &params);
+
+private slots:
+    void sendResponseMessage(const QByteArray &json, int requests);
+
+private:
+    friend class ResponseHandler;
+    friend class ResponseBatch;
+
+    // Shared with the ResponseHandler objects, so they can reply from
+    // any thread, even while the peer is being destroyed.
+    struct Link
+    {
+        QMutex mutex;
+        Peer *peer;
+    };
+
+    // message can be empty, when the requests are finished without a
+    // response
+    static void postReply(const QSharedPointer<Link> &link,
+                          const QByteArray &message, int requests);
+
+    struct PendingCall
+    {
+        QPointer<QObject> receiver;
+        QByteArray returnMethod;
+        QByteArray errorMethod;
+        // set if identical calls can be attached to this one
+        QByteArray coalescingKey;
+        // ids of the identical calls waiting for this one
+        QList<qint64> followers;
+    };
+
+
+    static QByteArray serialize(const QVariant &json, Encoding encoding);
+
+    QVariant parse(const QByteArray &json, bool &ok, int options) const;
+    void handleRequest(const QVariant &json,
+                       const QSharedPointer<ResponseBatch> &batch);
+    void handleResponseObject(const QVariantMap &object);
+    void replyError(const Error &error,
+                    const QSharedPointer<ResponseBatch> &batch);
+
+    MethodRegistry *ensureMethodRegistry();
+    bool takePendingCall(const QVariant &id, PendingCall &call);
+    bool takePendingCall(qint64 callId, PendingCall &call);
+    static void deliverResult(const PendingCall &call, const QVariant &result,
+                              const QVariant &id);
+    void failCall(const PendingCall &call, int code, const QString &message,
+                  const QVariant &data, const QVariant &id);
+    static bool deliverError(const PendingCall &call, int code,
+                             const QString &message, const QVariant &data,
+                             const QVariant &id);
+    void countSent(const QByteArray &message);
+    void dispatch(const QSharedPointer<ResponseHandler> &handler);
+    static bool readRequest(const QVariantMap &object,
+                            ResponseHandler &handler);
+    void dispatchNotification(const ResponseHandler &request);
+    Metrics::MethodStats *methodStats(const QString &method);
+
+    QSharedPointer<Link> link;
+
+    ParserBackend m_parserBackend;
+    Encoding m_encoding;
+    bool m_lazyParams;
+    QPointer<MethodRegistry> m_methodRegistry;
+    QPointer<Metrics> m_metrics;
+    // the stats of m_metrics already resolved by this peer, so the
+    // requests don't take the lock of the metrics
+    QHash<QString, Metrics::MethodStats *> m_methodStats;
+
+    // only changed in the thread of the peer
+    int inFlightRequests;
+    // when the message being handled was received, or 0
+    qint64 messageTime;
+    qint64 m_bytesReceived;
+    qint64 m_bytesSent;
+
+    qint64 lastCallId;
+    QHash<qint64, PendingCall> pendingCalls;
+    bool m_callCoalescing;
+    // the id of the pending call of each coalescing key
+    QHash<QByteArray, qint64> coalescedCalls;
 };
 
 } // namespace JsonRPC
@@ -1,18 +1,42 @@
 QT += network
+# the compressed messages are inflated with zlib, under a size limit
+LIBS += -lz
 INCLUDEPATH += $$PWD/ $$PWD/3rdparty/
 
 # qt-json library
 HEADERS += $$PWD/3rdparty/qt-json/json.h
 SOURCES += $$PWD/3rdparty/qt-json/json.cpp
 
-HEADERS += $$PWD/error.h \
+HEADERS += $$PWD/cbor.h \
+        $$PWD/error.h \
         $$PWD/httphelper.h \
+        $$PWD/httpserver.h \
+        $$PWD/httpserver_p.h \
+        $$PWD/jsonparser.h \
+        $$PWD/methodregistry.h \
+        $$PWD/metrics.h \
         $$PWD/peer.h \
+        $$PWD/rawvalue.h \
+        $$PWD/responsebatch.h \
         $$PWD/responsehandler.h \
-        $$PWD/tcphelper.h
+        $$PWD/responsewriter.h \
+        $$PWD/resultcache.h \
+        $$PWD/tcphelper.h \
+        $$PWD/tcpserver.h \
+        $$PWD/tcpserver_p.h
 
-SOURCES += $$PWD/error.cpp \
+SOURCES += $$PWD/cbor.cpp \
+        $$PWD/error.cpp \
         $$PWD/httphelper.cpp \
+        $$PWD/httpserver.cpp \
+        $$PWD/jsonparser.cpp \
+        $$PWD/methodregistry.cpp \
+        $$PWD/metrics.cpp \
         $$PWD/peer.cpp \
+        $$PWD/rawvalue.cpp \
+        $$PWD/responsebatch.cpp \
         $$PWD/responsehandler.cpp \
-        $$PWD/tcphelper.cpp
+        $$PWD/responsewriter.cpp \
+        $$PWD/resultcache.cpp \
+        $$PWD/tcphelper.cpp \
+        $$PWD/tcpserver.cpp
@@ -0,0 +1,130 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "rawvalue.h"
+#include "jsonparser.h"
+#include "cbor.h"
+
+using namespace JsonRPC;
+
+namespace {
+
+inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// returns the position of the first non-space character at or after pos
+inline int skipSpaces(const QByteArray &data, int pos)
+{
+    while (pos < data.size() && isSpace(data[pos]))
+        ++pos;
+    return pos;
+}
+
+} // namespace
+
+RawValue::RawValue() :
+    m_format(JSON_FORMAT)
+{
+}
+
+RawValue::RawValue(const QByteArray &data, Format format) :
+    m_data(data),
+    m_format(format)
+{
+}
+
+bool RawValue::isValid() const
+{
+    return !m_data.isEmpty();
+}
+
+QByteArray RawValue::data() const
+{
+    return m_data;
+}
+
+RawValue::Format RawValue::format() const
+{
+    return m_format;
+}
+
+QVariant::Type RawValue::type() const
+{
+    if (m_data.isEmpty())
+        return QVariant::Invalid;
+
+    if (m_format == CBOR_FORMAT) {
+        const uchar header = m_data[0];
+
+        switch (header >> 5) {
+        case 4:
+            return QVariant::List;
+        case 5:
+            return QVariant::Map;
+        default:
+            // null and undefined
+            if (header == 0xf6 || header == 0xf7)
+                return QVariant::Invalid;
+            return QVariant::String;
+        }
+    }
+
+    switch (m_data[skipSpaces(m_data, 0)]) {
+    case '{':
+        return QVariant::Map;
+    case '[':
+        return QVariant::List;
+    case 'n':
+        return QVariant::Invalid;
+    default:
+        return QVariant::String;
+    }
+}
+
+bool RawValue::isEmpty() const
+{
+    if (m_data.isEmpty())
+        return true;
+
+    if (m_format == CBOR_FORMAT) {
+        // array or map header with zero elements
+        const uchar header = m_data[0];
+        return header == 0x80 || header == 0xa0;
+    }
+
+    const int begin = skipSpaces(m_data, 0);
+    if (m_data[begin] != '{' && m_data[begin] != '[')
+        return false;
+
+    const int next = skipSpaces(m_data, begin + 1);
+    return next < m_data.size()
+            && (m_data[next] == '}' || m_data[next] == ']');
+}
+
+QVariant RawValue::decode(bool &ok) const
+{
+    if (m_format == CBOR_FORMAT)
+        return Cbor::parse(m_data, ok);
+    else
+        return JsonParser::parse(m_data, ok);
+}
+
+QVariant RawValue::member(const QString &key, bool &ok) const
+{
+    if (m_format == CBOR_FORMAT)
+        return Cbor::parseMember(m_data.constData(), m_data.size(), key, ok);
+    else
+        return JsonParser::parseMember(m_data.constData(), m_data.size(),
+                                       key, ok);
+}
+
+QVariant RawValue::element(int index, bool &ok) const
+{
+    if (m_format == CBOR_FORMAT)
+        return Cbor::parseElement(m_data.constData(), m_data.size(), index,
+                                  ok);
+    else
+        return JsonParser::parseElement(m_data.constData(), m_data.size(),
+                                        index, ok);
+}
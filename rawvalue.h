@@ -0,0 +1,82 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_RAWVALUE_H
+#define QTJSONRPC_RAWVALUE_H
+
+#include <QVariant>
+#include <QByteArray>
+#include <QMetaType>
+
+namespace JsonRPC {
+
+/*!
+  A value kept as its undecoded bytes, copied from the message that
+  contained it. The bytes were already validated by the parser, so the
+  value is only decoded when it's needed.
+  JsonParser and Cbor generate RawValue objects for the params of the
+  requests when the RAW_PARAMS option is used.
+  */
+class RawValue
+{
+public:
+    enum Format
+    {
+        /*! UTF-8 encoded JSON text. */
+        JSON_FORMAT,
+        /*! CBOR data item. */
+        CBOR_FORMAT
+    };
+
+    /*!
+      Constructs an invalid RawValue.
+      */
+    RawValue();
+    /*!
+      Constructs a RawValue with \param data encoded as \param format.
+      */
+    RawValue(const QByteArray &data, Format format);
+
+    /*!
+      @return true if the object holds a value.
+      */
+    bool isValid() const;
+    QByteArray data() const;
+    Format format() const;
+
+    /*!
+      @return QVariant::Map for objects, QVariant::List for arrays,
+      QVariant::Invalid for null and QVariant::String for the other values,
+      without decoding the value.
+      */
+    QVariant::Type type() const;
+    /*!
+      @return true if the value is an empty object or array.
+      */
+    bool isEmpty() const;
+
+    /*!
+      @return the decoded value.
+      \param ok is set to false if the value couldn't be decoded.
+      */
+    QVariant decode(bool &ok) const;
+    /*!
+      Decodes only the member \param key of an object.
+      @return the member, or a null QVariant if it doesn't exist.
+      */
+    QVariant member(const QString &key, bool &ok) const;
+    /*!
+      Decodes only the element \param index of an array.
+      @return the element, or a null QVariant if it doesn't exist.
+      */
+    QVariant element(int index, bool &ok) const;
+
+private:
+    QByteArray m_data;
+    Format m_format;
+};
+
+} // namespace JsonRPC
+
+Q_DECLARE_METATYPE(JsonRPC::RawValue)
+
+#endif // QTJSONRPC_RAWVALUE_H
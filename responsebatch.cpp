@@ -0,0 +1,89 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "responsebatch.h"
+#include "peer.h"
+#include "responsewriter.h"
+
+using namespace JsonRPC;
+
+ResponseBatch::ResponseBatch(Peer *peer) :
+    link(peer->link),
+    m_encoding(peer->encoding()),
+    responseCount(0),
+    requests(0),
+    pending(0),
+    sealed(false)
+{
+}
+
+void ResponseBatch::addPending()
+{
+    QMutexLocker locker(&mutex);
+    ++pending;
+    ++requests;
+}
+
+Peer::Encoding ResponseBatch::encoding() const
+{
+    return m_encoding;
+}
+
+void ResponseBatch::addResponse(const QByteArray &response)
+{
+    mutex.lock();
+    append(response);
+    --pending;
+    flush();
+}
+
+void ResponseBatch::cancelPending()
+{
+    mutex.lock();
+    --pending;
+    flush();
+}
+
+void ResponseBatch::addError(const QByteArray &error)
+{
+    QMutexLocker locker(&mutex);
+    append(error);
+}
+
+void ResponseBatch::seal()
+{
+    mutex.lock();
+    sealed = true;
+    flush();
+}
+
+// must be called with the mutex locked
+void ResponseBatch::append(const QByteArray &response)
+{
+    if (responseCount++ && m_encoding == Peer::JSON_ENCODING)
+        responses.append(',');
+
+    responses.append(response);
+}
+
+// must be called with the mutex locked, it unlocks the mutex
+void ResponseBatch::flush()
+{
+    if (!sealed || pending || (responses.isEmpty() && !requests)) {
+        // a batch made only of notifications has no response
+        mutex.unlock();
+        return;
+    }
+
+    // the requests may have been finished without responses
+    QByteArray batch;
+    if (!responses.isEmpty())
+        ResponseWriter::writeBatch(batch, responses, responseCount, m_encoding);
+
+    const int finished = requests;
+    responses.clear();
+    responseCount = 0;
+    requests = 0;
+    mutex.unlock();
+
+    Peer::postReply(link, batch, finished);
+}
@@ -0,0 +1,76 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_RESPONSEBATCH_H
+#define QTJSONRPC_RESPONSEBATCH_H
+
+#include <QVariant>
+#include <QMutex>
+
+#include "peer.h"
+
+namespace JsonRPC {
+
+/*!
+  Collects the responses to the requests of a batch message and sends
+  them to the peer as a single array, once the last request has been
+  answered. The responses are added already serialized, in the encoding
+  of the peer when the batch was created.
+  It's used by the Peer and ResponseHandler classes.
+  All methods are thread-safe, so the requests of a batch can be answered
+  from different threads.
+  */
+class ResponseBatch
+{
+public:
+    explicit ResponseBatch(Peer *peer);
+
+    /*!
+      Registers a request that will be answered later, through
+      addResponse or cancelPending.
+      */
+    void addPending();
+    /*!
+      Adds the response to a pending request.
+      */
+    void addResponse(const QByteArray &response);
+    /*!
+      Marks a pending request as finished without a response (e.g. its
+      ResponseHandler was destroyed before replying).
+      */
+    void cancelPending();
+    /*!
+      Adds a response that doesn't belong to a pending request (e.g. an
+      INVALID_REQUEST error).
+      */
+    void addError(const QByteArray &error);
+    /*!
+      Tells the batch that all requests were dispatched. The responses
+      are sent as soon as there are no pending requests left.
+      */
+    void seal();
+
+    /*!
+      @return the encoding of the responses of the batch.
+      */
+    Peer::Encoding encoding() const;
+
+private:
+    void append(const QByteArray &response);
+    void flush();
+
+    QMutex mutex;
+    QSharedPointer<Peer::Link> link;
+    const Peer::Encoding m_encoding;
+    // the serialized responses, separated by commas in the JSON encoding
+    QByteArray responses;
+    int responseCount;
+    // the requests added with addPending, reported to the peer when the
+    // batch is sent
+    int requests;
+    int pending;
+    bool sealed;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_RESPONSEBATCH_H
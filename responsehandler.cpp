@@ -3,15 +3,243 @@
 #include "responsehandler.h"
 #include "error.h"
 #include "peer.h"
+#include "responsebatch.h"
+#include "responsewriter.h"
+#include "resultcache.h"
 
-#include <QVariantMap>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QThreadStorage>
+#include <QVector>
 
 using namespace JsonRPC;
 
+namespace {
+
+// freed handlers kept for reuse in the free list of each thread
+const int MAX_POOLED_HANDLERS = 1024;
+// the counts of a pool are added to the totals after this many allocations
+const int POOL_COUNTS_FLUSH_INTERVAL = 256;
+
+struct HandlerPoolTotals
+{
+    HandlerPoolTotals() :
+        hits(0),
+        misses(0)
+    {
+    }
+
+    QMutex mutex;
+    qint64 hits;
+    qint64 misses;
+};
+
+} // namespace
+
+Q_GLOBAL_STATIC(HandlerPoolTotals, handlerPoolTotals)
+
+namespace {
+
+struct HandlerPool;
+
+// Prepended to the memory of each handler, so it can be given back to the
+// pool of the thread that allocated it.
+union BlockHeader
+{
+    // while the handler is alive, or NULL if it isn't pooled
+    HandlerPool *pool;
+    // while the block is in the returned stack of its pool
+    BlockHeader *next;
+    // keeps the handler aligned
+    double alignment;
+};
+
+// The memory of the handlers allocated by a thread. The blocks destroyed
+// in that thread go to a free list without a lock. The blocks destroyed
+// in other threads (e.g. by POOLED_EXECUTION methods) are pushed to a
+// lock-free stack, that is moved to the free list when it's empty.
+// The pool lives while its thread runs or any of its handlers is alive.
+struct HandlerPool
+{
+    HandlerPool() :
+        returned(NULL),
+        refs(1),
+        alive(1),
+        hits(0),
+        misses(0)
+    {
+        blocks.reserve(MAX_POOLED_HANDLERS);
+    }
+
+    ~HandlerPool()
+    {
+        freeBlocks();
+    }
+
+    // called in the thread of the pool
+    BlockHeader *take()
+    {
+        if (blocks.isEmpty())
+            reclaim();
+
+        BlockHeader *block = NULL;
+        if (!blocks.isEmpty()) {
+            block = blocks.last();
+            blocks.remove(blocks.size() - 1);
+        }
+
+        count(block != NULL);
+        return block;
+    }
+
+    // called in the thread of the pool
+    void put(BlockHeader *block)
+    {
+        if (blocks.size() < MAX_POOLED_HANDLERS)
+            blocks.push_back(block);
+        else
+            ::operator delete(block);
+    }
+
+    // called in any other thread
+    void giveBack(BlockHeader *block)
+    {
+        BlockHeader *head;
+        do {
+            head = returned;
+            block->next = head;
+        } while (!returned.testAndSetOrdered(head, block));
+    }
+
+    // only the thread of the pool takes the blocks, and it takes the
+    // whole stack at once, so the stack is safe from the ABA problem
+    void reclaim()
+    {
+        BlockHeader *block = returned.fetchAndStoreOrdered(NULL);
+        while (block) {
+            BlockHeader *next = block->next;
+            put(block);
+            block = next;
+        }
+    }
+
+    void freeBlocks()
+    {
+        Q_FOREACH (BlockHeader *block, blocks)
+            ::operator delete(block);
+        blocks.clear();
+
+        BlockHeader *block = returned.fetchAndStoreOrdered(NULL);
+        while (block) {
+            BlockHeader *next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+
+    void release()
+    {
+        if (!refs.deref())
+            delete this;
+    }
+
+    void count(bool hit)
+    {
+        if (hit)
+            ++hits;
+        else
+            ++misses;
+
+        if (hits + misses >= POOL_COUNTS_FLUSH_INTERVAL)
+            flushCounts();
+    }
+
+    void flushCounts()
+    {
+        // the totals are already destroyed at exit
+        HandlerPoolTotals *totals = handlerPoolTotals();
+        if (totals) {
+            QMutexLocker locker(&totals->mutex);
+            totals->hits += hits;
+            totals->misses += misses;
+        }
+
+        hits = 0;
+        misses = 0;
+    }
+
+    QVector<BlockHeader *> blocks;
+    QAtomicPointer<BlockHeader> returned;
+    // the thread and each alive handler
+    QAtomicInt refs;
+    // cleared when the thread finishes, the blocks are freed from then on
+    QAtomicInt alive;
+    int hits;
+    int misses;
+};
+
+// deleted by QThreadStorage when the thread finishes
+struct HandlerPoolHandle
+{
+    HandlerPoolHandle() :
+        pool(new HandlerPool)
+    {
+    }
+
+    ~HandlerPoolHandle()
+    {
+        pool->alive = 0;
+        pool->flushCounts();
+        pool->freeBlocks();
+        pool->release();
+    }
+
+    HandlerPool *const pool;
+};
+
+} // namespace
+
+Q_GLOBAL_STATIC(QThreadStorage<HandlerPoolHandle *>, handlerPools)
+
 ResponseHandler::ResponseHandler(Peer *peer) :
     peer(peer),
+    encoding(Peer::JSON_ENCODING),
+    counted(false),
+    metrics(NULL),
+    methodStats(NULL),
+    receivedAt(0),
+    m_hasId(false)
+{
+    if (peer) {
+        link = peer->link;
+        encoding = peer->encoding();
+    }
+}
+
+ResponseHandler::~ResponseHandler()
+{
+    release();
+}
+
+ResponseHandler::ResponseHandler(const ResponseHandler &other) :
+    peer(NULL),
+    encoding(Peer::JSON_ENCODING),
+    counted(false),
+    metrics(NULL),
+    methodStats(NULL),
+    receivedAt(0),
     m_hasId(false)
 {
+    assign(other);
+}
+
+ResponseHandler &ResponseHandler::operator=(const ResponseHandler &other)
+{
+    if (this != &other) {
+        release();
+        assign(other);
+    }
+    return *this;
 }
 
 QString ResponseHandler::method() const
@@ -30,6 +258,9 @@ bool ResponseHandler::setMethod(const QString &method)
 
 bool ResponseHandler::hasParams() const
 {
+    if (m_rawParams.isValid())
+        return !m_rawParams.isEmpty();
+
     if (!m_params.isNull()) {
         if (m_params.type() == QVariant::List) {
             return !m_params.toList().isEmpty();
@@ -42,9 +273,56 @@ bool ResponseHandler::hasParams() const
 
 QVariant ResponseHandler::params() const
 {
+    if (m_rawParams.isValid()) {
+        // the bytes were validated by the parser
+        bool ok;
+        m_params = m_rawParams.decode(ok);
+        m_rawParams = RawValue();
+    }
+
     return m_params;
 }
 
+QVariant::Type ResponseHandler::paramsType() const
+{
+    if (m_rawParams.isValid())
+        return m_rawParams.type();
+
+    return m_params.type();
+}
+
+QVariant ResponseHandler::param(const QString &key) const
+{
+    bool ok;
+
+    if (m_rawParams.isValid()) {
+        if (m_rawParams.type() != QVariant::Map)
+            return QVariant();
+        return m_rawParams.member(key, ok);
+    }
+
+    if (m_params.type() != QVariant::Map)
+        return QVariant();
+
+    return m_params.toMap().value(key);
+}
+
+QVariant ResponseHandler::param(int index) const
+{
+    bool ok;
+
+    if (m_rawParams.isValid()) {
+        if (m_rawParams.type() != QVariant::List || index < 0)
+            return QVariant();
+        return m_rawParams.element(index, ok);
+    }
+
+    if (m_params.type() != QVariant::List)
+        return QVariant();
+
+    return m_params.toList().value(index);
+}
+
 bool ResponseHandler::setParams(const QVariant &params)
 {
     const QVariant::Type paramsType = params.type();
@@ -54,12 +332,31 @@ bool ResponseHandler::setParams(const QVariant &params)
         return false;
 
     m_params = params;
+    m_rawParams = RawValue();
     return true;
 }
 
+bool ResponseHandler::setRawParams(const RawValue &params)
+{
+    switch (params.type()) {
+    case QVariant::Map:
+    case QVariant::List:
+        m_params = QVariant();
+        m_rawParams = params;
+        return true;
+    case QVariant::Invalid:
+        // null
+        resetParams();
+        return true;
+    default:
+        return false;
+    }
+}
+
 void ResponseHandler::resetParams()
 {
     m_params = QVariant();
+    m_rawParams = RawValue();
 }
 
 bool ResponseHandler::hasId() const
@@ -95,7 +392,89 @@ void ResponseHandler::resetId()
 
 bool ResponseHandler::isNull() const
 {
-    return !static_cast<bool>(peer);
+    if (!peer)
+        return true;
+
+    // the peer can be destroyed by its thread at any time
+    QMutexLocker locker(&link->mutex);
+    return !link->peer;
+}
+
+void *ResponseHandler::operator new(size_t size)
+{
+    // subclasses aren't pooled
+    if (size != sizeof(ResponseHandler))
+        return ::operator new(size);
+
+    QThreadStorage<HandlerPoolHandle *> *pools = handlerPools();
+    HandlerPool *pool = NULL;
+    BlockHeader *block = NULL;
+
+    // the storage is already destroyed at exit
+    if (pools) {
+        if (!pools->hasLocalData())
+            pools->setLocalData(new HandlerPoolHandle);
+
+        pool = pools->localData()->pool;
+        pool->refs.ref();
+        block = pool->take();
+    }
+
+    if (!block)
+        block = static_cast<BlockHeader *>(::operator new(sizeof(BlockHeader)
+                                                          + size));
+
+    block->pool = pool;
+    return block + 1;
+}
+
+void ResponseHandler::operator delete(void *pointer, size_t size)
+{
+    if (!pointer)
+        return;
+
+    if (size != sizeof(ResponseHandler)) {
+        ::operator delete(pointer);
+        return;
+    }
+
+    BlockHeader *block = static_cast<BlockHeader *>(pointer) - 1;
+    HandlerPool *pool = block->pool;
+    if (!pool) {
+        ::operator delete(block);
+        return;
+    }
+
+    QThreadStorage<HandlerPoolHandle *> *pools = handlerPools();
+    if (pools && pools->hasLocalData() && pools->localData()->pool == pool)
+        pool->put(block);
+    else if (pool->alive)
+        pool->giveBack(block);
+    else
+        ::operator delete(block);
+
+    // it can be the last reference, after the thread of the pool finished
+    pool->release();
+}
+
+qint64 ResponseHandler::poolHits()
+{
+    HandlerPoolTotals *totals = handlerPoolTotals();
+    if (!totals)
+        return 0;
+
+    QMutexLocker locker(&totals->mutex);
+    return totals->hits;
+}
+
+qint64 ResponseHandler::poolMisses()
+{
+    HandlerPoolTotals *totals = handlerPoolTotals();
+    if (!totals)
+        return 0;
+
+    QMutexLocker locker(&totals->mutex);
+    return totals->misses;
 }
 
 void ResponseHandler::response(const QVariant &result)
@@ -106,20 +485,57 @@ void ResponseHandler::response(const QVariant &result)
     if (!peer)
         return;
 
-    QVariantMap response;
+    QByteArray response;
+    bool ok;
+    if (cache) {
+        // the result is serialized apart, so it can answer the next
+        // requests with the same params
+        const QByteArray serialized = ResponseWriter::serialize(result,
+                                                                encoding, ok);
+        if (ok) {
+            cache->insert(cacheKey, serialized);
+            ResponseWriter::writeSerializedResult(response, serialized, m_id,
+                                                  encoding);
+        }
+        cache.clear();
+    } else {
+        ok = ResponseWriter::writeResult(response, result, m_id, encoding);
+    }
+
+    // the other side would receive invalid JSON
+    if (!ok) {
+        qWarning("JsonRPC::ResponseHandler: the result of \"%s\" can't be"
+                 " serialized", qPrintable(m_method));
+        error(Error(INTERNAL_ERROR));
+        return;
+    }
+
+    sendResult(response);
+}
+
+void ResponseHandler::error(const JsonRPC::Error &error)
+{
+    if (!m_hasId)
+        peer = NULL;
+
+    if (!peer)
+        return;
 
-    response.insert("jsonrpc", "2.0");
-    response.insert("result", result);
-    response.insert("id", m_id);
+    const QByteArray response = ResponseWriter::error(error, m_id, encoding);
 
-    peer->reply(response);
+    if (methodStats) {
+        metrics->recordError(methodStats, error.code,
+                             Metrics::clock() - receivedAt);
+    }
+
+    send(response);
 
     // doing this will avoid more than one response
     // per request
     peer = NULL;
 }
 
-void ResponseHandler::error(const JsonRPC::Error &error)
+void ResponseHandler::cachedResponse(const QByteArray &result)
 {
     if (!m_hasId)
         peer = NULL;
@@ -127,13 +543,78 @@ void ResponseHandler::error(const JsonRPC::Error &error)
     if (!peer)
         return;
 
-    QVariantMap response = static_cast<QVariantMap>(error);
+    QByteArray response;
+    ResponseWriter::writeSerializedResult(response, result, m_id, encoding);
+    sendResult(response);
+}
 
-    response.insert("id", m_id);
+void ResponseHandler::sendResult(const QByteArray &response)
+{
+    if (methodStats)
+        metrics->recordResponse(methodStats, Metrics::clock() - receivedAt);
 
-    peer->reply(response);
+    send(response);
 
     // doing this will avoid more than one response
     // per request
     peer = NULL;
 }
+
+QSharedPointer<ResponseHandler> ResponseHandler::copy() const
+{
+    QSharedPointer<ResponseHandler> handler(new ResponseHandler);
+    handler->m_method = m_method;
+    handler->m_params = m_params;
+    handler->m_rawParams = m_rawParams;
+    return handler;
+}
+
+// the batch slot, the flow control and the metrics stay with other
+void ResponseHandler::assign(const ResponseHandler &other)
+{
+    peer = other.peer;
+    link = other.link;
+    encoding = other.encoding;
+    m_method = other.m_method;
+    m_params = other.m_params;
+    m_rawParams = other.m_rawParams;
+    m_hasId = other.m_hasId;
+    m_id = other.m_id;
+}
+
+void ResponseHandler::release()
+{
+    if (batch)
+        batch->cancelPending();
+    else if (counted)
+        Peer::postReply(link, QByteArray(), 1);
+
+    batch.clear();
+    counted = false;
+    metrics = NULL;
+    methodStats = NULL;
+    cache.clear();
+}
+
+void ResponseHandler::setBatch(const QSharedPointer<ResponseBatch> &batch)
+{
+    // requests without id are notifications and have no place in the
+    // batch response
+    if (!m_hasId)
+        return;
+
+    this->batch = batch;
+    encoding = batch->encoding();
+    batch->addPending();
+}
+
+void ResponseHandler::send(const QByteArray &response)
+{
+    if (batch) {
+        batch->addResponse(response);
+        batch.clear();
+    } else {
+        Peer::postReply(link, response, counted ? 1 : 0);
+        counted = false;
+    }
+}
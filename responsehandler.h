@@ -4,13 +4,19 @@
 #define PHOBOS_RESPONSEHANDLER_H
 
 #include <QVariant>
-#include <QPointer>
+#include <QSharedPointer>
+#include <QMetaType>
 
 #include "error.h"
+#include "peer.h"
+#include "rawvalue.h"
+#include "metrics.h"
 
 namespace JsonRPC {
 
 class Peer;
+class ResponseBatch;
+class ResultCache;
 
 class ResponseHandler
 {
@@ -20,6 +26,25 @@ public:
       when responding some message.
       */
     explicit ResponseHandler(Peer *peer = 0);
+    /*!
+      If the request is part of a batch and no response was sent, the
+      batch stops waiting for this request.
+      The object can be destroyed in any thread.
+      */
+    ~ResponseHandler();
+    /*!
+      Creates a handler that can also answer the request of \param other.
+      The copy isn't counted in the flow control nor in the metrics of
+      the peer and, if the request is part of a batch, its response is
+      sent apart from the batch response.
+      */
+    ResponseHandler(const ResponseHandler &other);
+    /*!
+      Releases the request of this handler, as the destructor does, and
+      copies \param other.
+      @sa ResponseHandler(const ResponseHandler &)
+      */
+    ResponseHandler &operator=(const ResponseHandler &other);
 
     /*! method getter.
       @return a string containing the method name
@@ -39,12 +64,31 @@ public:
       */
     bool hasParams() const;
     /*! params getter
+      If the params were received undecoded (see Peer::setLazyParams),
+      they're decoded in the first call.
       @return the params object (a QVariantMap or a QVariantList),
       or a null QVariant if params object doesn't exist.
       @sa hasParams
       @sa setParams
       */
     QVariant params() const;
+    /*!
+      @return the member \param key of the params object, or a null
+      QVariant if it doesn't exist or the params object isn't a map.
+      If the params weren't decoded yet, only this member is decoded.
+      */
+    QVariant param(const QString &key) const;
+    /*!
+      @return the type of the params object (QVariant::Map,
+      QVariant::List or QVariant::Invalid), without decoding it.
+      */
+    QVariant::Type paramsType() const;
+    /*!
+      @return the element \param index of the params array, or a null
+      QVariant if it doesn't exist or the params object isn't a list.
+      If the params weren't decoded yet, only this element is decoded.
+      */
+    QVariant param(int index) const;
     /*! params setter
       \param params can be any valid params object according
       the json-rpc 2.0 spec (QVariantMap and QVariantList).
@@ -92,6 +136,9 @@ public:
     bool isNull() const;
     /*! Sends the response object to the peer object, if it still exists.
       Use this method when you wants send the response.
+      It can be called from any thread. The response is serialized in
+      the calling thread and, if it isn't the thread of the peer,
+      delivered to the peer through its event loop.
       @warning use this method when the object is in null state won't do
       anything
       @sa isNull
@@ -99,18 +146,72 @@ public:
     void response(const QVariant &result);
     /*! Sends the response error object to the peer object, if it still exists.
       Use this method when you wants send an error response.
+      It can be called from any thread.
       @warning use this method when the object is in null state won't do
       anything
       @sa isNull
       */
     void error(const Error &error);
 
+    /*!
+      The memory of the destroyed handlers is given back to a free list
+      of the thread that allocated them, and reused by the next handlers
+      created in that thread, so the handling of a request doesn't
+      allocate its handler nor take a lock in the steady state. The
+      handlers destroyed in other threads (e.g. by POOLED_EXECUTION
+      methods) are returned through a lock-free stack.
+      */
+    static void *operator new(size_t size);
+    static void operator delete(void *pointer, size_t size);
+    /*!
+      @return the number of handlers allocated from the free lists. The
+      counts of each thread are added in batches, so the recent
+      allocations may be missing.
+      */
+    static qint64 poolHits();
+    /*!
+      @return the number of handlers allocated because the free list was
+      empty.
+      */
+    static qint64 poolMisses();
+
 private:
-    QPointer<Peer> peer;
+    friend class Peer;
+    friend class AbstractMethod;
+    friend class MethodRegistry;
+
+    // a null handler with the method and params of this one
+    QSharedPointer<ResponseHandler> copy() const;
+    void assign(const ResponseHandler &other);
+    void release();
+    void setBatch(const QSharedPointer<ResponseBatch> &batch);
+    bool setRawParams(const RawValue &params);
+    void cachedResponse(const QByteArray &result);
+    void sendResult(const QByteArray &response);
+    void send(const QByteArray &response);
+
+    // set until a response is sent, the replies go through link
+    Peer *peer;
+    QSharedPointer<Peer::Link> link;
+    QSharedPointer<ResponseBatch> batch;
+    Peer::Encoding encoding;
+    // the peer counts this request as in flight until it's answered
+    bool counted;
+
+    // set by the peer when it has metrics
+    Metrics *metrics;
+    Metrics::MethodStats *methodStats;
+    qint64 receivedAt;
+
+    // set by the registry when the result must be stored in the cache
+    QSharedPointer<ResultCache> cache;
+    QByteArray cacheKey;
 
     QString m_method;
 
-    QVariant m_params;
+    // decoded on demand, only one of them is set
+    mutable QVariant m_params;
+    mutable RawValue m_rawParams;
 
     bool m_hasId;
     QVariant m_id;
@@ -118,4 +219,7 @@ private:
 
 } // namespace JsonRPC
 
+// allows the handlers to be sent through queued connections
+Q_DECLARE_METATYPE(QSharedPointer<JsonRPC::ResponseHandler>)
+
 #endif // PHOBOS_RESPONSEHANDLER_H
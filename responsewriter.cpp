@@ -0,0 +1,259 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "responsewriter.h"
+#include "error.h"
+#include "cbor.h"
+
+#include <QVariantMap>
+
+#include <qt-json/json.h>
+
+using namespace JsonRPC;
+
+namespace {
+
+// {"jsonrpc":"2.0","result":
+const char JSON_RESULT_PREFIX[] = "{\"jsonrpc\":\"2.0\",\"result\":";
+// {"jsonrpc":"2.0","error":
+const char JSON_ERROR_PREFIX[] = "{\"jsonrpc\":\"2.0\",\"error\":";
+const char JSON_ID[] = ",\"id\":";
+
+// map(3) "jsonrpc" "2.0" "result"
+const char CBOR_RESULT_PREFIX[] = "\xa3" "\x67" "jsonrpc" "\x63" "2.0"
+                                  "\x66" "result";
+// map(3) "jsonrpc" "2.0" "error"
+const char CBOR_ERROR_PREFIX[] = "\xa3" "\x67" "jsonrpc" "\x63" "2.0"
+                                 "\x65" "error";
+const char CBOR_ID[] = "\x62" "id";
+
+const ErrorCode standardCodes[] = {
+    PARSE_ERROR,
+    INVALID_REQUEST,
+    METHOD_NOT_FOUND,
+    INVALID_PARAMS
+};
+
+const int STANDARD_ERRORS = sizeof(standardCodes) / sizeof(standardCodes[0]);
+const int ENCODINGS = 2;
+
+template<int N>
+inline void append(QByteArray &out, const char (&fragment)[N])
+{
+    // the terminating null isn't part of the fragment
+    out.append(fragment, N - 1);
+}
+
+// returns false, without writing anything, if value can't be serialized
+inline bool writeValue(QByteArray &out, const QVariant &value,
+                       Peer::Encoding encoding)
+{
+    if (encoding == Peer::CBOR_ENCODING) {
+        Cbor::serialize(out, value);
+        return true;
+    }
+
+    switch (value.type()) {
+    case QVariant::Invalid:
+        out.append("null", 4);
+        break;
+    case QVariant::Int:
+    case QVariant::LongLong:
+        out.append(QByteArray::number(value.toLongLong()));
+        break;
+    default:
+    {
+        bool ok;
+        const QByteArray json = QtJson::Json::serialize(value, ok);
+        if (!ok)
+            return false;
+        out.append(json);
+        break;
+    }
+    }
+    return true;
+}
+
+QVariantMap errorObject(const Error &error)
+{
+    QVariantMap object;
+    object.insert("code", int(error.code));
+    object.insert("message", error.desc);
+    return object;
+}
+
+// the serialized standard errors, computed once
+class StandardErrors
+{
+public:
+    StandardErrors()
+    {
+        for (int e = 0;e != ENCODINGS;++e) {
+            const Peer::Encoding encoding = Peer::Encoding(e);
+
+            for (int i = 0;i != STANDARD_ERRORS;++i) {
+                const Error error(standardCodes[i]);
+                descriptions[i] = error.desc;
+
+                QByteArray &object = objects[e][i];
+                writeValue(object, errorObject(error), encoding);
+
+                QByteArray &message = messages[e][i];
+                if (encoding == Peer::CBOR_ENCODING) {
+                    append(message, CBOR_ERROR_PREFIX);
+                    message.append(object);
+                    append(message, CBOR_ID);
+                } else {
+                    append(message, JSON_ERROR_PREFIX);
+                    message.append(object);
+                    append(message, JSON_ID);
+                }
+                writeValue(message, QVariant(), encoding);
+                if (encoding == Peer::JSON_ENCODING)
+                    message.append('}');
+            }
+        }
+    }
+
+    // returns the index of error, or -1 if it isn't a standard error
+    int indexOf(const Error &error) const
+    {
+        for (int i = 0;i != STANDARD_ERRORS;++i) {
+            if (error.code == standardCodes[i])
+                return error.desc == descriptions[i] ? i : -1;
+        }
+        return -1;
+    }
+
+    QString descriptions[STANDARD_ERRORS];
+    // the error member
+    QByteArray objects[ENCODINGS][STANDARD_ERRORS];
+    // the whole response, with a null id
+    QByteArray messages[ENCODINGS][STANDARD_ERRORS];
+};
+
+Q_GLOBAL_STATIC(StandardErrors, standardErrors)
+
+} // namespace
+
+bool ResponseWriter::writeResult(QByteArray &out, const QVariant &result,
+                                 const QVariant &id, Peer::Encoding encoding)
+{
+    const int size = out.size();
+
+    if (encoding == Peer::CBOR_ENCODING)
+        append(out, CBOR_RESULT_PREFIX);
+    else
+        append(out, JSON_RESULT_PREFIX);
+
+    if (!writeValue(out, result, encoding)) {
+        out.truncate(size);
+        return false;
+    }
+
+    if (encoding == Peer::CBOR_ENCODING) {
+        append(out, CBOR_ID);
+        writeValue(out, id, encoding);
+    } else {
+        append(out, JSON_ID);
+        writeValue(out, id, encoding);
+        out.append('}');
+    }
+    return true;
+}
+
+void ResponseWriter::writeSerializedResult(QByteArray &out,
+                                           const QByteArray &result,
+                                           const QVariant &id,
+                                           Peer::Encoding encoding)
+{
+    if (encoding == Peer::CBOR_ENCODING) {
+        append(out, CBOR_RESULT_PREFIX);
+        out.append(result);
+        append(out, CBOR_ID);
+        writeValue(out, id, encoding);
+    } else {
+        append(out, JSON_RESULT_PREFIX);
+        out.append(result);
+        append(out, JSON_ID);
+        writeValue(out, id, encoding);
+        out.append('}');
+    }
+}
+
+void ResponseWriter::writeError(QByteArray &out, const Error &error,
+                                const QVariant &id, Peer::Encoding encoding)
+{
+    const StandardErrors *errors = standardErrors();
+    const int index = errors->indexOf(error);
+
+    if (index != -1 && id.isNull()) {
+        out.append(errors->messages[encoding][index]);
+        return;
+    }
+
+    if (encoding == Peer::CBOR_ENCODING)
+        append(out, CBOR_ERROR_PREFIX);
+    else
+        append(out, JSON_ERROR_PREFIX);
+
+    if (index != -1)
+        out.append(errors->objects[encoding][index]);
+    else
+        writeValue(out, errorObject(error), encoding);
+
+    if (encoding == Peer::CBOR_ENCODING) {
+        append(out, CBOR_ID);
+        writeValue(out, id, encoding);
+    } else {
+        append(out, JSON_ID);
+        writeValue(out, id, encoding);
+        out.append('}');
+    }
+}
+
+void ResponseWriter::writeBatch(QByteArray &out, const QByteArray &responses,
+                                int count, Peer::Encoding encoding)
+{
+    if (encoding == Peer::CBOR_ENCODING) {
+        // the array header takes 5 bytes at most
+        out.reserve(out.size() + responses.size() + 5);
+        Cbor::serializeArrayHeader(out, count);
+        out.append(responses);
+    } else {
+        out.reserve(out.size() + responses.size() + 2);
+        out.append('[');
+        out.append(responses);
+        out.append(']');
+    }
+}
+
+QByteArray ResponseWriter::error(const Error &error, const QVariant &id,
+                                 Peer::Encoding encoding)
+{
+    if (id.isNull()) {
+        const StandardErrors *errors = standardErrors();
+        const int index = errors->indexOf(error);
+
+        if (index != -1)
+            return errors->messages[encoding][index];
+    }
+
+    QByteArray out;
+    writeError(out, error, id, encoding);
+    return out;
+}
+
+QByteArray ResponseWriter::serialize(const QVariant &value,
+                                     Peer::Encoding encoding)
+{
+    bool ok;
+    return serialize(value, encoding, ok);
+}
+
+QByteArray ResponseWriter::serialize(const QVariant &value,
+                                     Peer::Encoding encoding, bool &ok)
+{
+    QByteArray out;
+    ok = writeValue(out, value, encoding);
+    return out;
+}
@@ -0,0 +1,81 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_RESPONSEWRITER_H
+#define QTJSONRPC_RESPONSEWRITER_H
+
+#include <QVariant>
+#include <QByteArray>
+
+#include "peer.h"
+
+namespace JsonRPC {
+
+struct Error;
+
+/*!
+  Writes response messages directly into a byte buffer.
+  The constant parts of the envelope are precomputed byte fragments, so
+  only the result, the id and the non-standard errors are serialized for
+  each response. The standard errors are serialized once.
+  It's used by the Peer, ResponseHandler, ResponseBatch and Error
+  classes.
+  All methods are thread-safe.
+  */
+class ResponseWriter
+{
+public:
+    /*!
+      Appends the response with \param result to the request \param id
+      to \param out.
+      @return false, leaving \param out unchanged, if \param result
+      can't be serialized.
+      */
+    static bool writeResult(QByteArray &out, const QVariant &result,
+                            const QVariant &id, Peer::Encoding encoding);
+    /*!
+      Appends the response with the already serialized \param result
+      to the request \param id to \param out.
+      @sa serialize
+      */
+    static void writeSerializedResult(QByteArray &out, const QByteArray &result,
+                                      const QVariant &id,
+                                      Peer::Encoding encoding);
+    /*!
+      Appends the error response \param error to the request \param id
+      to \param out.
+      */
+    static void writeError(QByteArray &out, const Error &error,
+                           const QVariant &id, Peer::Encoding encoding);
+    /*!
+      Appends the batch response with the \param count messages
+      concatenated in \param responses to \param out. In the JSON
+      encoding, the messages in \param responses must be separated by
+      commas.
+      */
+    static void writeBatch(QByteArray &out, const QByteArray &responses,
+                           int count, Peer::Encoding encoding);
+
+    /*!
+      @return the error response \param error to the request \param id.
+      The standard errors with a null id are not serialized again, a
+      shared copy is returned.
+      */
+    static QByteArray error(const Error &error, const QVariant &id,
+                            Peer::Encoding encoding);
+
+    /*!
+      @return \param value serialized in \param encoding, as it's
+      written in the messages.
+      */
+    static QByteArray serialize(const QVariant &value, Peer::Encoding encoding);
+    /*!
+      Like serialize, but \param ok is set to false if \param value
+      can't be serialized.
+      */
+    static QByteArray serialize(const QVariant &value, Peer::Encoding encoding,
+                                bool &ok);
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_RESPONSEWRITER_H
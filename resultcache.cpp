@@ -0,0 +1,79 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "resultcache.h"
+#include "metrics.h"
+
+using namespace JsonRPC;
+
+ResultCache::ResultCache(int ttl, int maxSize) :
+    entries(maxSize),
+    ttl(qint64(ttl) * 1000000),
+    hits(0),
+    misses(0),
+    evictions(0),
+    expirations(0)
+{
+}
+
+bool ResultCache::find(const QByteArray &key, QByteArray &result)
+{
+    QMutexLocker locker(&mutex);
+
+    Entry *entry = entries.object(key);
+    if (!entry) {
+        ++misses;
+        return false;
+    }
+
+    if (entry->expiresAt <= Metrics::clock()) {
+        entries.remove(key);
+        ++expirations;
+        ++misses;
+        return false;
+    }
+
+    ++hits;
+    result = entry->result;
+    return true;
+}
+
+void ResultCache::insert(const QByteArray &key, const QByteArray &result)
+{
+    const int cost = key.size() + result.size();
+
+    QMutexLocker locker(&mutex);
+
+    // QCache would discard it anyway, after removing the old entry
+    if (cost > entries.maxCost())
+        return;
+
+    Entry *entry = new Entry;
+    entry->result = result;
+    entry->expiresAt = Metrics::clock() + ttl;
+
+    // the entries evicted by QCache to make room aren't reported, they
+    // are counted by the difference of the sizes
+    const int expected = entries.size() + (entries.contains(key) ? 0 : 1);
+    entries.insert(key, entry, cost);
+    evictions += expected - entries.size();
+}
+
+void ResultCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    entries.clear();
+}
+
+QVariantMap ResultCache::statistics() const
+{
+    QMutexLocker locker(&mutex);
+
+    QVariantMap map;
+    map.insert("entries", entries.size());
+    map.insert("bytes", entries.totalCost());
+    map.insert("hits", hits);
+    map.insert("misses", misses);
+    map.insert("evictions", evictions);
+    map.insert("expirations", expirations);
+    return map;
+}
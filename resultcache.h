@@ -0,0 +1,77 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_RESULTCACHE_H
+#define QTJSONRPC_RESULTCACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QMutex>
+#include <QVariant>
+
+namespace JsonRPC {
+
+/*!
+  Serialized results of a cacheable method (see
+  MethodRegistry::setCacheable), keyed by the encoding and the params of
+  the request. The results are stored without the id, so a cached result
+  answers any request with the same params.
+  The entries expire after a fixed time and the least recently used ones
+  are evicted when the total size exceeds the limit.
+  It's used by the MethodRegistry and ResponseHandler classes.
+  All methods are thread-safe.
+  */
+class ResultCache
+{
+public:
+    /*!
+      Creates a cache whose entries expire after \param ttl milliseconds
+      and whose keys and results take up to \param maxSize bytes.
+      */
+    ResultCache(int ttl, int maxSize);
+
+    /*!
+      Finds the result stored as \param key and copies it to
+      \param result.
+      @return false if there's no result or if it expired.
+      */
+    bool find(const QByteArray &key, QByteArray &result);
+    /*!
+      Stores \param result as \param key. Results larger than the limit
+      aren't stored.
+      */
+    void insert(const QByteArray &key, const QByteArray &result);
+    /*!
+      Removes all entries. The statistics are kept.
+      */
+    void clear();
+
+    /*!
+      @return a map with the number of "entries", their size in "bytes"
+      and the counts of "hits", "misses", "evictions" (entries removed to
+      respect the size limit) and "expirations".
+      */
+    QVariantMap statistics() const;
+
+private:
+    Q_DISABLE_COPY(ResultCache)
+
+    struct Entry
+    {
+        QByteArray result;
+        qint64 expiresAt;
+    };
+
+    mutable QMutex mutex;
+    QCache<QByteArray, Entry> entries;
+    // in nanoseconds, like Metrics::clock
+    const qint64 ttl;
+
+    qint64 hits;
+    qint64 misses;
+    qint64 evictions;
+    qint64 expirations;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_RESULTCACHE_H
@@ -1,17 +1,223 @@
 //  Copyright © 2011  Vinícius dos Santos Oliveira
 
 #include "tcphelper.h"
+#include "methodregistry.h"
+#include "responsehandler.h"
+#include "metrics.h"
+#include <QLocalSocket>
 #include <QTcpSocket>
-#include <QDataStream>
+#include <QtEndian>
+
+#include <zlib.h>
 
 using namespace JsonRPC;
 
+static const quint32 SIZE_MASK_32BIT = 0x3fffffff;
+static const int FLAGS_SHIFT_32BIT = 30;
+static const quint32 FLAG_CBOR = 0x2;
+static const quint32 FLAG_COMPRESSED = 0x1;
+
 TcpHelper::TcpHelper(QObject *parent) :
     QObject(parent),
     peer(NULL),
+    m_framing(FRAMING_16BIT),
+    m_encoding(Peer::JSON_ENCODING),
+    remoteAcceptsCbor(false),
+    m_compression(false),
+    m_compressionThreshold(1024),
+    remoteAcceptsCompression(false),
+    m_writeCoalescing(true),
+    m_lowDelay(false),
+    m_callCoalescing(false),
+    m_maxInFlightRequests(0),
+    m_maxBufferedBytes(0),
+    m_maxMessageSize(16 * 1024 * 1024),
     socket(NULL),
-    nextMessageSize(0)
+    bufferOffset(0),
+    hasMessageSize(false),
+    nextMessageSize(0),
+    nextMessageFlags(0),
+    flushScheduled(false),
+    m_bytesReceived(0),
+    m_bytesSent(0),
+    paused(false)
+{
+}
+
+TcpHelper::Framing TcpHelper::framing() const
+{
+    return m_framing;
+}
+
+void TcpHelper::setFraming(Framing framing)
+{
+    m_framing = framing;
+}
+
+Peer::Encoding TcpHelper::encoding() const
+{
+    return m_encoding;
+}
+
+void TcpHelper::setEncoding(Peer::Encoding encoding)
+{
+    if (encoding == m_encoding)
+        return;
+
+    m_encoding = encoding;
+
+    // advertises the support, if the connection is already established
+    if (socket && m_framing == FRAMING_32BIT && encoding == Peer::CBOR_ENCODING)
+        writeFrame(QByteArray(), FLAG_CBOR);
+
+    updateEncoding();
+}
+
+Peer::Encoding TcpHelper::activeEncoding() const
+{
+    return peer ? peer->encoding() : Peer::JSON_ENCODING;
+}
+
+void TcpHelper::updateEncoding()
+{
+    if (!peer)
+        return;
+
+    if (m_framing == FRAMING_32BIT && m_encoding == Peer::CBOR_ENCODING
+            && remoteAcceptsCbor)
+        peer->setEncoding(Peer::CBOR_ENCODING);
+    else
+        peer->setEncoding(Peer::JSON_ENCODING);
+}
+
+bool TcpHelper::compression() const
+{
+    return m_compression;
+}
+
+void TcpHelper::setCompression(bool enabled)
+{
+    if (enabled == m_compression)
+        return;
+
+    m_compression = enabled;
+
+    // advertises the support, if the connection is already established
+    if (socket && m_framing == FRAMING_32BIT && enabled)
+        writeFrame(QByteArray(), FLAG_COMPRESSED);
+}
+
+int TcpHelper::compressionThreshold() const
+{
+    return m_compressionThreshold;
+}
+
+void TcpHelper::setCompressionThreshold(int size)
+{
+    m_compressionThreshold = qMax(0, size);
+}
+
+bool TcpHelper::isCompressionActive() const
+{
+    return socket && m_framing == FRAMING_32BIT && m_compression
+            && remoteAcceptsCompression;
+}
+
+bool TcpHelper::writeCoalescing() const
+{
+    return m_writeCoalescing;
+}
+
+void TcpHelper::setWriteCoalescing(bool enabled)
+{
+    m_writeCoalescing = enabled;
+
+    if (!enabled)
+        flushWrites();
+}
+
+bool TcpHelper::lowDelay() const
+{
+    return m_lowDelay;
+}
+
+void TcpHelper::setLowDelay(bool enabled)
+{
+    m_lowDelay = enabled;
+
+    QAbstractSocket *tcpSocket = qobject_cast<QAbstractSocket *>(socket);
+    if (tcpSocket)
+        tcpSocket->setSocketOption(QAbstractSocket::LowDelayOption, enabled ? 1 : 0);
+}
+
+int TcpHelper::maxInFlightRequests() const
+{
+    return m_maxInFlightRequests;
+}
+
+void TcpHelper::setMaxInFlightRequests(int max)
+{
+    m_maxInFlightRequests = max;
+    resumeReading();
+}
+
+qint64 TcpHelper::maxBufferedBytes() const
+{
+    return m_maxBufferedBytes;
+}
+
+void TcpHelper::setMaxBufferedBytes(qint64 max)
+{
+    m_maxBufferedBytes = max;
+    resumeReading();
+}
+
+int TcpHelper::maxMessageSize() const
+{
+    return m_maxMessageSize;
+}
+
+void TcpHelper::setMaxMessageSize(int size)
 {
+    m_maxMessageSize = qMax(0, size);
+}
+
+bool TcpHelper::isReadingPaused() const
+{
+    return paused;
+}
+
+qint64 TcpHelper::bufferedBytes() const
+{
+    return socket->bytesToWrite() + writeBuffer.size();
+}
+
+bool TcpHelper::overLimits() const
+{
+    return (m_maxInFlightRequests > 0
+            && peer->inFlightRequestCount() >= m_maxInFlightRequests)
+            || (m_maxBufferedBytes > 0 && bufferedBytes() > m_maxBufferedBytes);
+}
+
+void TcpHelper::resumeReading()
+{
+    if (!paused || !peer)
+        return;
+
+    // the outbound buffer must drain to half of the limit, so the reading
+    // isn't paused and resumed once per message
+    if ((m_maxInFlightRequests > 0
+         && peer->inFlightRequestCount() >= m_maxInFlightRequests)
+            || (m_maxBufferedBytes > 0
+                && bufferedBytes() > m_maxBufferedBytes / 2))
+        return;
+
+    paused = false;
+    setReadBufferSize(0);
+
+    // handles the messages already buffered, it's queued because this slot
+    // can be called while the socket is emitting its signals
+    QMetaObject::invokeMethod(this, "onReadyRead", Qt::QueuedConnection);
 }
 
 bool TcpHelper::setSocket(QTcpSocket *socket)
@@ -20,35 +226,98 @@ bool TcpHelper::setSocket(QTcpSocket *socket)
         onDisconnected();
 
     if (socket && socket->state() == QAbstractSocket::ConnectedState) {
-        socket->setParent(this);
-
-        connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
-        connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
-
+        if (m_lowDelay)
+            socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
 
-        peer = new Peer(this);
-
-        connect(peer, SIGNAL(readyRequestMessage(QByteArray)),
-                this, SLOT(onReadyMessage(QByteArray)));
-        connect(peer, SIGNAL(readyResponseMessage(QByteArray)),
-                this, SLOT(onReadyMessage(QByteArray)));
+        attachSocket(socket);
+        return true;
+    } else {
+        return false;
+    }
+}
 
-        connect(peer, SIGNAL(readyResponse(QVariant,QVariant)),
-                this, SIGNAL(readyResponse(QVariant,QVariant)));
-        connect(peer, SIGNAL(requestError(int,QString,QVariant,QVariant)),
-                this, SIGNAL(requestError(int,QString,QVariant,QVariant)));
-        connect(peer,
-                SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)),
-                this,
-                SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+bool TcpHelper::setLocalSocket(QLocalSocket *socket)
+{
+    if (this->socket)
+        onDisconnected();
 
-        this->socket = socket;
+    if (socket && socket->state() == QLocalSocket::ConnectedState) {
+        attachSocket(socket);
         return true;
     } else {
         return false;
     }
 }
 
+void TcpHelper::attachSocket(QIODevice *socket)
+{
+    socket->setParent(this);
+
+    connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    connect(socket, SIGNAL(bytesWritten(qint64)),
+            this, SLOT(resumeReading()));
+
+    peer = new Peer(this);
+    peer->setMethodRegistry(m_methodRegistry);
+    peer->setMetrics(m_metrics);
+    peer->setCallCoalescing(m_callCoalescing);
+
+    connect(peer, SIGNAL(readyRequestMessage(QByteArray)),
+            this, SLOT(onReadyMessage(QByteArray)));
+    connect(peer, SIGNAL(readyResponseMessage(QByteArray)),
+            this, SLOT(onReadyMessage(QByteArray)));
+
+    connect(peer, SIGNAL(readyResponse(QVariant,QVariant)),
+            this, SIGNAL(readyResponse(QVariant,QVariant)));
+    connect(peer, SIGNAL(requestError(int,QString,QVariant,QVariant)),
+            this, SIGNAL(requestError(int,QString,QVariant,QVariant)));
+    connect(peer,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)),
+            this,
+            SLOT(onReadyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+    connect(peer, SIGNAL(requestsFinished(int)),
+            this, SLOT(resumeReading()));
+
+    this->socket = socket;
+    m_bytesReceived = 0;
+    m_bytesSent = 0;
+
+    // each feature is advertised in its own frame, so a peer that
+    // doesn't know one of the flags only discards that frame
+    if (m_framing == FRAMING_32BIT && m_encoding == Peer::CBOR_ENCODING)
+        writeFrame(QByteArray(), FLAG_CBOR);
+    if (m_framing == FRAMING_32BIT && m_compression)
+        writeFrame(QByteArray(), FLAG_COMPRESSED);
+}
+
+// QIODevice doesn't have these operations, they're in each socket class
+void TcpHelper::setReadBufferSize(qint64 size)
+{
+    QAbstractSocket *tcpSocket = qobject_cast<QAbstractSocket *>(socket);
+    if (tcpSocket) {
+        tcpSocket->setReadBufferSize(size);
+        return;
+    }
+
+    QLocalSocket *localSocket = qobject_cast<QLocalSocket *>(socket);
+    if (localSocket)
+        localSocket->setReadBufferSize(size);
+}
+
+void TcpHelper::flushSocket()
+{
+    QAbstractSocket *tcpSocket = qobject_cast<QAbstractSocket *>(socket);
+    if (tcpSocket) {
+        tcpSocket->flush();
+        return;
+    }
+
+    QLocalSocket *localSocket = qobject_cast<QLocalSocket *>(socket);
+    if (localSocket)
+        localSocket->flush();
+}
+
 bool TcpHelper::call(const QString &method, const QVariant &params, const QVariant &id)
 {
     if (peer)
@@ -57,59 +326,399 @@ bool TcpHelper::call(const QString &method, const QVariant &params, const QVaria
         return false;
 }
 
+QVariant TcpHelper::call(const QString &method, const QVariant &params,
+                         QObject *receiver, const char *returnMethod,
+                         const char *errorMethod)
+{
+    if (peer)
+        return peer->call(method, params, receiver, returnMethod, errorMethod);
+    else
+        return QVariant();
+}
+
+bool TcpHelper::notify(const QString &method, const QVariant &params)
+{
+    if (peer)
+        return peer->notify(method, params);
+    else
+        return false;
+}
+
+int TcpHelper::pendingCallCount() const
+{
+    return peer ? peer->pendingCallCount() : 0;
+}
+
+bool TcpHelper::callCoalescing() const
+{
+    return m_callCoalescing;
+}
+
+void TcpHelper::setCallCoalescing(bool enabled)
+{
+    m_callCoalescing = enabled;
+
+    if (peer)
+        peer->setCallCoalescing(enabled);
+}
+
+qint64 TcpHelper::bytesReceived() const
+{
+    return m_bytesReceived;
+}
+
+qint64 TcpHelper::bytesSent() const
+{
+    return m_bytesSent;
+}
+
+Metrics *TcpHelper::metrics() const
+{
+    return m_metrics;
+}
+
+void TcpHelper::setMetrics(Metrics *metrics)
+{
+    m_metrics = metrics;
+
+    if (peer)
+        peer->setMetrics(metrics);
+}
+
+MethodRegistry *TcpHelper::methodRegistry() const
+{
+    return m_methodRegistry;
+}
+
+void TcpHelper::setMethodRegistry(MethodRegistry *registry)
+{
+    m_methodRegistry = registry;
+
+    if (peer)
+        peer->setMethodRegistry(registry);
+}
+
+bool TcpHelper::registerMethod(const QString &name, QObject *receiver,
+                               const char *member,
+                               MethodRegistry::ExecutionMode mode)
+{
+    return ensureMethodRegistry()->registerMethod(name, receiver, member,
+                                                  mode);
+}
+
+bool TcpHelper::registerMethod(const QString &name, AbstractMethod *method,
+                               MethodRegistry::ExecutionMode mode)
+{
+    return ensureMethodRegistry()->registerMethod(name, method, mode);
+}
+
+MethodRegistry *TcpHelper::ensureMethodRegistry()
+{
+    if (!m_methodRegistry)
+        setMethodRegistry(new MethodRegistry(this));
+
+    return m_methodRegistry;
+}
+
 void TcpHelper::onReadyMessage(const QByteArray &json)
 {
-    {
-        QDataStream stream(socket);
-        stream.setVersion(QDataStream::Qt_4_6);
-        quint16 size = json.size();
-        stream << size;
+    // A JSON text starts with an ASCII character, while a CBOR encoded
+    // message starts with a map or array header (0x80 or above). The
+    // check is needed because the responses produced by other threads
+    // may be encoded before a change of the encoding.
+    const quint32 flags = (m_framing == FRAMING_32BIT && !json.isEmpty()
+                           && uchar(json[0]) >= 0x80) ? FLAG_CBOR : 0;
+
+    if (json.size() >= m_compressionThreshold && isCompressionActive()) {
+        const QByteArray compressed = qCompress(json);
+
+        // incompressible messages are sent as they are
+        if (compressed.size() < json.size()) {
+            writeFrame(compressed, flags | FLAG_COMPRESSED);
+            return;
+        }
+    }
+
+    writeFrame(json, flags);
+}
+
+void TcpHelper::writeFrame(const QByteArray &message, quint32 flags)
+{
+    // the header and the message are written in a single call
+    if (m_framing == FRAMING_32BIT) {
+        if (quint32(message.size()) > SIZE_MASK_32BIT) {
+            qWarning("JsonRPC::TcpHelper: message too big, discarded");
+            return;
+        }
+
+        uchar header[4];
+        qToBigEndian<quint32>(message.size() | (flags << FLAGS_SHIFT_32BIT),
+                              header);
+        writeBuffer.append(reinterpret_cast<const char *>(header), 4);
+    } else {
+        if (message.size() > 0xffff) {
+            qWarning("JsonRPC::TcpHelper: message too big, discarded");
+            return;
+        }
+
+        uchar header[2];
+        qToBigEndian<quint16>(message.size(), header);
+        writeBuffer.append(reinterpret_cast<const char *>(header), 2);
+    }
+
+    writeBuffer.append(message);
+
+    if (!m_writeCoalescing) {
+        flushWrites();
+    } else if (!flushScheduled) {
+        flushScheduled = true;
+        QMetaObject::invokeMethod(this, "flushWrites", Qt::QueuedConnection);
     }
-    socket->write(json);
 }
 
-void TcpHelper::onReadyRead()
+void TcpHelper::flushWrites()
 {
-    buffer.append(socket->readAll());
+    flushScheduled = false;
+
+    if (!socket || writeBuffer.isEmpty())
+        return;
 
-    if (nextMessageSize)
-        goto STATE_WAITING_FOR_CONTENT;
+    const qint64 written = socket->write(writeBuffer);
+    if (written > 0)
+        m_bytesSent += written;
+    flushSocket();
+    writeBuffer.clear();
+}
 
-    STATE_UNKNOW_SIZE:
-    // nextMessageSize is 2 bytes long (quint16)
-    if (buffer.size() >= 2) {
-        QDataStream stream(&buffer, QIODevice::ReadWrite);
-        stream.setVersion(QDataStream::Qt_4_6);
-        stream >> nextMessageSize;
-        buffer.remove(0, 2);
-    } else {
+// Inflates a message made by qCompress. qUncompress isn't used because
+// it trusts the size prepended by the sender and keeps doubling its
+// buffer while the data inflates, so a small message could allocate GBs.
+// The output never grows beyond maxSize (0 means no limit). Returns false
+// if the message is invalid or, setting tooLarge, if it exceeds maxSize.
+bool TcpHelper::uncompress(const QByteArray &message, int maxSize,
+                           QByteArray &result, bool &tooLarge)
+{
+    tooLarge = false;
+    if (message.size() <= 4)
+        return false;
+
+    const int limit = maxSize > 0 ? maxSize : int(SIZE_MASK_32BIT);
+
+    // the declared size is only a hint for the first allocation
+    const quint32 declared = qFromBigEndian<quint32>(
+                reinterpret_cast<const uchar *>(message.constData()));
+    if (declared > quint32(limit)) {
+        tooLarge = true;
+        return false;
+    }
+
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = reinterpret_cast<Bytef *>(
+                const_cast<char *>(message.constData() + 4));
+    stream.avail_in = message.size() - 4;
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+
+    // one byte beyond the limit tells a message of exactly maxSize bytes
+    // from a larger one
+    const int capacity = limit + 1;
+    result.resize(qMin(capacity, int(qBound(quint32(1024), declared + 1,
+                                            quint32(64 * 1024)))));
+    int produced = 0;
+
+    while (true) {
+        stream.next_out = reinterpret_cast<Bytef *>(result.data() + produced);
+        stream.avail_out = result.size() - produced;
+
+        const int status = inflate(&stream, Z_NO_FLUSH);
+        produced = result.size() - stream.avail_out;
+
+        if (produced > limit) {
+            tooLarge = true;
+            break;
+        }
+
+        if (status == Z_STREAM_END) {
+            inflateEnd(&stream);
+            result.resize(produced);
+            return produced > 0;
+        }
+
+        if (status != Z_OK && status != Z_BUF_ERROR)
+            break;
+
+        if (stream.avail_out) {
+            // the input ended before the stream
+            if (!stream.avail_in)
+                break;
+        } else {
+            result.resize(int(qMin(qint64(result.size()) * 2,
+                                   qint64(capacity))));
+        }
+    }
+
+    inflateEnd(&stream);
+    result.clear();
+    return false;
+}
+
+void TcpHelper::dropOversizedMessage()
+{
+    qWarning("JsonRPC::TcpHelper: message exceeds the maximum of %d bytes,"
+             " closing the connection", m_maxMessageSize);
+
+    // the rest of the stream can't be trusted
+    buffer.clear();
+    bufferOffset = 0;
+    hasMessageSize = false;
+    socket->close();
+}
+
+void TcpHelper::onReadyRead()
+{
+    // while paused, the data is left in the socket, so the TCP flow
+    // control slows down the other side
+    if (!socket || paused)
         return;
+
+    // The handled bytes are only removed from the buffer when they are at
+    // least half of it, so a burst of small messages doesn't move the
+    // remaining data once per message.
+    if (bufferOffset && bufferOffset >= buffer.size() - bufferOffset) {
+        buffer.remove(0, bufferOffset);
+        bufferOffset = 0;
     }
 
-    STATE_WAITING_FOR_CONTENT:
-    if (buffer.size() >= nextMessageSize) {
-        peer->handleMessage(buffer.left(nextMessageSize));
-        buffer.remove(0, nextMessageSize);
+    const QByteArray received = socket->readAll();
+    m_bytesReceived += received.size();
+    buffer.append(received);
+
+    while (peer) {
+        const char *data = buffer.constData() + bufferOffset;
+        const quint32 available = buffer.size() - bufferOffset;
+
+        if (!hasMessageSize) {
+            if (available && overLimits()) {
+                // a read buffer of 0 bytes means unlimited
+                paused = true;
+                setReadBufferSize(1);
+                break;
+            }
+
+            const uchar *header = reinterpret_cast<const uchar *>(data);
+
+            if (m_framing == FRAMING_32BIT) {
+                if (available < 4)
+                    break;
 
-        nextMessageSize = 0;
-        goto STATE_UNKNOW_SIZE;
+                const quint32 value = qFromBigEndian<quint32>(header);
+                nextMessageSize = value & SIZE_MASK_32BIT;
+                nextMessageFlags = value >> FLAGS_SHIFT_32BIT;
+                bufferOffset += 4;
+            } else {
+                if (available < 2)
+                    break;
+
+                nextMessageSize = qFromBigEndian<quint16>(header);
+                nextMessageFlags = 0;
+                bufferOffset += 2;
+            }
+
+            if (m_maxMessageSize > 0
+                    && nextMessageSize > quint32(m_maxMessageSize)) {
+                dropOversizedMessage();
+                return;
+            }
+
+            hasMessageSize = true;
+            continue;
+        }
+
+        if (available < nextMessageSize)
+            break;
+
+        bufferOffset += nextMessageSize;
+        hasMessageSize = false;
+
+        // the message shares the buffer memory, no copy is made
+        const QByteArray message = QByteArray::fromRawData(data,
+                                                           nextMessageSize);
+
+        if (!nextMessageFlags) {
+            peer->handleMessage(message);
+        } else if (message.isEmpty()) {
+            // the other side advertises what it accepts
+            if (nextMessageFlags & FLAG_CBOR) {
+                remoteAcceptsCbor = true;
+                updateEncoding();
+            }
+            if (nextMessageFlags & FLAG_COMPRESSED)
+                remoteAcceptsCompression = true;
+        } else {
+            const Peer::Encoding encoding = (nextMessageFlags & FLAG_CBOR)
+                    ? Peer::CBOR_ENCODING : Peer::JSON_ENCODING;
+
+            if (nextMessageFlags & FLAG_COMPRESSED) {
+                QByteArray inflated;
+                bool tooLarge;
+                if (uncompress(message, m_maxMessageSize, inflated, tooLarge)) {
+                    peer->handleMessage(inflated, encoding);
+                } else if (tooLarge) {
+                    dropOversizedMessage();
+                    return;
+                } else {
+                    qWarning("JsonRPC::TcpHelper: invalid compressed message, discarded");
+                }
+            } else {
+                peer->handleMessage(message, encoding);
+            }
+        }
+    }
+
+    if (bufferOffset == buffer.size()) {
+        buffer.clear();
+        bufferOffset = 0;
     }
 }
 
+void TcpHelper::onReadyRequest(QSharedPointer<ResponseHandler> handler)
+{
+    if (receivers(SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>))))
+        emit readyRequest(handler);
+    else
+        handler->error(Error(METHOD_NOT_FOUND));
+}
+
 void TcpHelper::onDisconnected()
 {
-    // clear peer data
-    peer->deleteLater();
+    // clear peer data, the calls made by the callbacks of the pending
+    // calls fail because the peer is already gone
+    Peer *oldPeer = peer;
     peer = NULL;
 
     // clear buffer data
     buffer.clear();
+    bufferOffset = 0;
+    hasMessageSize = false;
     nextMessageSize = 0;
+    nextMessageFlags = 0;
+    writeBuffer.clear();
+    remoteAcceptsCbor = false;
+    remoteAcceptsCompression = false;
+    paused = false;
 
     // clear socket data
     socket->disconnect();
     socket->deleteLater();
     socket = NULL;
 
+    // the error callbacks of the pending calls are run, as HttpHelper
+    // does when a request fails
+    oldPeer->failPendingCalls(INTERNAL_ERROR, "The connection was closed.");
+    oldPeer->deleteLater();
+
     emit disconnected();
 }
@@ -5,29 +5,187 @@
 
 #include "peer.h"
 
+#include <QPointer>
+
+class QIODevice;
+class QLocalSocket;
 class QTcpSocket;
 
 namespace JsonRPC {
 
 /*! TcpHelper is a helper class to use JSON-RPC over tpc sockets.
   It uses the core classes of JsonRPC to implement this.
+  The same protocol can be used over local sockets (Unix domain sockets
+  or named pipes, see setLocalSocket), that avoid the TCP stack for peers
+  running in the same host.
   The protocol is:
 
   [message size][JSON-RPC message]
 
-  [message size] is a 16-bit unsigned integer, serialized by QDataStream
+  [message size] is a big-endian unsigned integer (the same format used
+  by QDataStream), 16-bit or 32-bit long, according to the framing mode.
+  In the 32-bit mode, the two most significant bits are reserved for
+  flags. The most significant one marks CBOR encoded messages and the
+  other one marks compressed messages (the output of qCompress).
+
+  In the 32-bit mode, the JSON-RPC messages can also be CBOR encoded.
+  A peer that accepts CBOR sends an empty message with the CBOR flag set
+  as soon as the connection is established, and each side only starts
+  to send CBOR after receiving it from the other side. Until then, and
+  when the other side never advertises it, the messages are JSON
+  encoded. Each message is decoded according to its own flag, so both
+  encodings can be mixed in the same connection.
+
+  Compression is negotiated in the same way, with an empty message that
+  has only the compression flag set. Only the messages larger than the
+  compression threshold are compressed, and only when it makes them
+  smaller.
 
   Using this class you only need to care about handle the rpc requests,
   not the communication layer.
-  @warning using this protocol, the maximum size for each message is 65535
-  bytes.
+  @warning using the 16-bit framing (the default), the maximum size for
+  each message is 65535 bytes. Using the 32-bit framing, it's 1 GiB.
   */
 class TcpHelper : public QObject
 {
     Q_OBJECT
 public:
+    /*!
+      The size prefix used to delimit messages.
+      Both peers must use the same framing mode.
+      */
+    enum Framing
+    {
+        /*! 16-bit message size. */
+        FRAMING_16BIT,
+        /*! 32-bit message size, with 30 bits for the size and 2 bits
+          for flags. */
+        FRAMING_32BIT
+    };
+
     explicit TcpHelper(QObject *parent = 0);
 
+    /*!
+      @return the framing mode used in the communication.
+      */
+    Framing framing() const;
+    /*! Sets the framing mode used in the communication.
+      You should call this method before setSocket.
+      */
+    void setFraming(Framing framing);
+
+    /*!
+      @return the preferred encoding for the messages.
+      */
+    Peer::Encoding encoding() const;
+    /*! Sets the preferred encoding for the messages to \param encoding.
+      Peer::CBOR_ENCODING is only used with the 32-bit framing and after
+      the other side advertises support for it, otherwise the messages
+      are sent as JSON. The default is Peer::JSON_ENCODING.
+      @sa activeEncoding
+      */
+    void setEncoding(Peer::Encoding encoding);
+    /*!
+      @return the encoding currently used to send the messages.
+      */
+    Peer::Encoding activeEncoding() const;
+
+    /*!
+      @return true if the large messages can be compressed.
+      */
+    bool compression() const;
+    /*! Sets whether the messages larger than compressionThreshold are
+      compressed. Compression is only used with the 32-bit framing and
+      after the other side advertises support for it.
+      Compressed messages are always accepted. The default is false.
+      @sa isCompressionActive
+      */
+    void setCompression(bool enabled);
+    /*!
+      @return the minimum size, in bytes, of the compressed messages.
+      */
+    int compressionThreshold() const;
+    /*! Sets the minimum size, in bytes, of the compressed messages to
+      \param size. Small messages gain little and cost the zlib headers.
+      The default is 1024.
+      */
+    void setCompressionThreshold(int size);
+    /*!
+      @return true if the large messages are being compressed.
+      */
+    bool isCompressionActive() const;
+
+    /*!
+      @return true if the messages are coalesced before being written.
+      @sa setWriteCoalescing
+      */
+    bool writeCoalescing() const;
+    /*! Sets whether the messages produced in the same event loop
+      iteration are gathered and written to the socket at once, when the
+      control returns to the event loop (the default), or written as soon
+      as they are produced.
+      */
+    void setWriteCoalescing(bool enabled);
+
+    /*!
+      @return true if the Nagle's algorithm is disabled for the socket.
+      */
+    bool lowDelay() const;
+    /*! Sets the TCP_NODELAY option (QAbstractSocket::LowDelayOption) of
+      the socket. With write coalescing, disabling the Nagle's algorithm
+      doesn't produce a small segment per message.
+      The default is false.
+      */
+    void setLowDelay(bool enabled);
+
+    /*!
+      @return the maximum number of received requests waiting for a
+      response, or 0 if there is no limit.
+      */
+    int maxInFlightRequests() const;
+    /*! Sets the maximum number of received requests waiting for a
+      response to \param max. When it's reached, the socket isn't read
+      until some of the requests are answered. Notifications aren't
+      counted, and neither are the calls made by this side.
+      The default is 0 (no limit).
+      @sa Peer::inFlightRequestCount
+      */
+    void setMaxInFlightRequests(int max);
+
+    /*!
+      @return the maximum number of outbound bytes waiting to be written,
+      or 0 if there is no limit.
+      */
+    qint64 maxBufferedBytes() const;
+    /*! Sets the maximum number of outbound bytes waiting to be written
+      (QAbstractSocket::bytesToWrite plus the coalesced messages) to
+      \param max. When it's exceeded, the socket isn't read until the
+      outbound data drains to half of \param max.
+      The default is 0 (no limit).
+      */
+    void setMaxBufferedBytes(qint64 max);
+
+    /*!
+      @return the maximum size of a received message, in bytes, or 0 if
+      there is no limit.
+      */
+    int maxMessageSize() const;
+    /*! Sets the maximum size of a received message to \param size bytes.
+      It limits both the size of the frames and the size of the
+      compressed messages once inflated. When a frame announces a larger
+      size, the connection is closed before its data is buffered. When a
+      compressed message inflates beyond the limit, the inflation stops
+      there and the connection is closed.
+      The default is 16 MiB.
+      */
+    void setMaxMessageSize(int size);
+
+    /*!
+      @return true if the reading of the socket is paused, because of
+      maxInFlightRequests or maxBufferedBytes.
+      */
+    bool isReadingPaused() const;
+
     /*! Sets the socket used be in the communication.
       \param socket must be in connected state.
       The TcpHelper takes parentship.
@@ -36,6 +194,96 @@ public:
       @return true in success (socket connected)
       */
     bool setSocket(QTcpSocket *socket);
+    /*! Sets the local socket used in the communication, like setSocket.
+      All other features work in the same way, except lowDelay, that
+      only applies to TCP sockets.
+      \param socket must be in connected state.
+      The TcpHelper takes parentship.
+      @return true in success (socket connected)
+      */
+    bool setLocalSocket(QLocalSocket *socket);
+
+    /*!
+      @return the number of calls made with a completion callback that
+      are still waiting for a response.
+      @sa Peer::pendingCallCount
+      */
+    int pendingCallCount() const;
+
+    /*!
+      @return true if identical calls are coalesced.
+      */
+    bool callCoalescing() const;
+    /*!
+      Sets whether a call identical to a pending one waits for its
+      response instead of being sent. The default is false.
+      @sa Peer::setCallCoalescing
+      */
+    void setCallCoalescing(bool enabled);
+
+    /*!
+      @return the number of bytes read from the current socket,
+      including the framing.
+      */
+    qint64 bytesReceived() const;
+    /*!
+      @return the number of bytes written to the current socket,
+      including the framing.
+      */
+    qint64 bytesSent() const;
+
+    /*!
+      @return the object where the requests are recorded, or NULL if
+      none.
+      */
+    Metrics *metrics() const;
+    /*!
+      Sets the object where the requests are recorded to \param metrics.
+      TcpHelper doesn't take the ownership of \param metrics.
+      @sa Peer::setMetrics
+      */
+    void setMetrics(Metrics *metrics);
+
+    /*!
+      @return the registry used to dispatch requests, or NULL if none.
+      */
+    MethodRegistry *methodRegistry() const;
+    /*!
+      Sets the registry used to dispatch requests to \param registry.
+      TcpHelper doesn't take the ownership of \param registry.
+      @sa Peer::setMethodRegistry
+      */
+    void setMethodRegistry(MethodRegistry *registry);
+    /*!
+      Registers the method \param name in the registry of this helper,
+      creating one if necessary.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, QObject *receiver,
+                        const char *member,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the method \param name in the registry of this helper,
+      creating one if necessary.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, AbstractMethod *method,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the function \param function as the method \param name
+      in the registry of this helper, creating one if necessary.
+      @sa MethodRegistry::registerFunction
+      */
+    template<typename Function>
+    bool registerFunction(const QString &name, Function function,
+                          const QStringList &names = QStringList(),
+                          MethodRegistry::ExecutionMode mode
+                          = MethodRegistry::DIRECT_EXECUTION)
+    {
+        return ensureMethodRegistry()->registerFunction(name, function, names, mode);
+    }
 
 signals:
     /*!
@@ -52,7 +300,8 @@ signals:
       */
     void requestError(int code, QString message, QVariant data, QVariant id);
     /*!
-      Emitted when a new request message is available.
+      Emitted when a new request message is available and its method
+      isn't in the method registry.
       /param handler is the object that you use to send a response.
       @sa handleMessage
       */
@@ -70,18 +319,81 @@ public slots:
       according JSON-RPC 2.0 spec.
       */
     bool call(const QString &method, const QVariant &params, const QVariant &id);
+    /*!
+      Prepares a request message using an id generated by the peer and
+      delivers its response only to \param receiver.
+      @return the generated id, or a null QVariant on failure.
+      @sa Peer::call
+      */
+    QVariant call(const QString &method, const QVariant &params,
+                  QObject *receiver, const char *returnMethod,
+                  const char *errorMethod = 0);
+    /*!
+      Prepares a notification message, that is never answered.
+      @return true if \param method and \param params are valid,
+      according JSON-RPC 2.0 spec.
+      @sa Peer::notify
+      */
+    bool notify(const QString &method, const QVariant &params);
 
 private slots:
     void onReadyMessage(const QByteArray &json);
+    void onReadyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
     void onReadyRead();
     void onDisconnected();
+    void flushWrites();
+    void resumeReading();
 
 private:
+    MethodRegistry *ensureMethodRegistry();
+    void attachSocket(QIODevice *socket);
+    void setReadBufferSize(qint64 size);
+    void flushSocket();
+    void writeFrame(const QByteArray &message, quint32 flags);
+    void updateEncoding();
+    static bool uncompress(const QByteArray &message, int maxSize,
+                           QByteArray &result, bool &tooLarge);
+    void dropOversizedMessage();
+    qint64 bufferedBytes() const;
+    bool overLimits() const;
+
     Peer *peer;
 
-    QTcpSocket *socket;
+    Framing m_framing;
+    Peer::Encoding m_encoding;
+    // the other side advertised CBOR support
+    bool remoteAcceptsCbor;
+    bool m_compression;
+    int m_compressionThreshold;
+    // the other side advertised compression support
+    bool remoteAcceptsCompression;
+    bool m_writeCoalescing;
+    bool m_lowDelay;
+    bool m_callCoalescing;
+    int m_maxInFlightRequests;
+    qint64 m_maxBufferedBytes;
+    int m_maxMessageSize;
+    QPointer<MethodRegistry> m_methodRegistry;
+    QPointer<Metrics> m_metrics;
+
+    // a QTcpSocket or a QLocalSocket
+    QIODevice *socket;
+    // bytes before bufferOffset were already handled
     QByteArray buffer;
-    quint16 nextMessageSize;
+    int bufferOffset;
+    bool hasMessageSize;
+    quint32 nextMessageSize;
+    quint32 nextMessageFlags;
+
+    // framed messages waiting for flushWrites
+    QByteArray writeBuffer;
+    bool flushScheduled;
+
+    qint64 m_bytesReceived;
+    qint64 m_bytesSent;
+
+    // the limits were reached and the socket isn't being read
+    bool paused;
 };
 
 } // namespace JsonRPC
@@ -0,0 +1,369 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#include "tcpserver.h"
+#include "tcpserver_p.h"
+#include "responsehandler.h"
+
+#include <QLocalSocket>
+#include <QThread>
+#include <QTcpSocket>
+
+using namespace JsonRPC;
+
+TcpServerWorker::TcpServerWorker(TcpServer *server) :
+    server(server),
+    thread(new QThread)
+{
+    // delivered to the thread of the server
+    connect(this,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)),
+            server,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+
+    moveToThread(thread);
+    thread->start();
+}
+
+TcpServerWorker::~TcpServerWorker()
+{
+    // the connections were created in the worker thread, so their
+    // sockets and timers must be destroyed there
+    QMetaObject::invokeMethod(this, "closeConnections",
+                              Qt::BlockingQueuedConnection);
+
+    thread->quit();
+    thread->wait();
+    delete thread;
+}
+
+void TcpServerWorker::addConnection(qlonglong socketDescriptor, bool local,
+                                    int framing, int encoding,
+                                    bool compression,
+                                    int compressionThreshold,
+                                    int maxInFlightRequests,
+                                    qlonglong maxBufferedBytes,
+                                    int maxMessageSize)
+{
+    QTcpSocket *tcpSocket = NULL;
+    QLocalSocket *localSocket = NULL;
+    bool ok;
+
+    if (local) {
+        localSocket = new QLocalSocket;
+        ok = localSocket->setSocketDescriptor(quintptr(socketDescriptor));
+    } else {
+        tcpSocket = new QTcpSocket;
+        ok = tcpSocket->setSocketDescriptor(int(socketDescriptor));
+    }
+
+    if (!ok) {
+        delete localSocket;
+        delete tcpSocket;
+        connections.deref();
+        return;
+    }
+
+    TcpHelper *helper = new TcpHelper(this);
+    helper->setFraming(TcpHelper::Framing(framing));
+    helper->setEncoding(Peer::Encoding(encoding));
+    helper->setCompression(compression);
+    helper->setCompressionThreshold(compressionThreshold);
+    helper->setMaxInFlightRequests(maxInFlightRequests);
+    helper->setMaxBufferedBytes(maxBufferedBytes);
+    helper->setMaxMessageSize(maxMessageSize);
+    helper->setMethodRegistry(server->methodRegistry());
+    helper->setMetrics(server->metrics());
+
+    connect(helper,
+            SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)),
+            this,
+            SLOT(onReadyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+    connect(helper, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+
+    if (local)
+        helper->setLocalSocket(localSocket);
+    else
+        helper->setSocket(tcpSocket);
+}
+
+void TcpServerWorker::onReadyRequest(QSharedPointer<ResponseHandler> handler)
+{
+    // checked for each request, so the connections accepted before
+    // readyRequest was connected also forward their requests
+    if (server->forwardsRequests())
+        emit readyRequest(handler);
+    else
+        handler->error(Error(METHOD_NOT_FOUND));
+}
+
+void TcpServerWorker::onDisconnected()
+{
+    sender()->deleteLater();
+    connections.deref();
+}
+
+void TcpServerWorker::closeConnections()
+{
+    // children() changes while the objects are deleted
+    const QObjectList objects = children();
+    qDeleteAll(objects);
+}
+
+TcpServerLocalListener::TcpServerLocalListener(TcpServer *server) :
+    QLocalServer(server),
+    server(server)
+{
+}
+
+void TcpServerLocalListener::incomingConnection(quintptr socketDescriptor)
+{
+    server->addConnection(qlonglong(socketDescriptor), true);
+}
+
+TcpServer::TcpServer(QObject *parent) :
+    QTcpServer(parent),
+    m_threadCount(qMax(1, QThread::idealThreadCount())),
+    m_loadBalancing(LEAST_CONNECTIONS),
+    m_framing(TcpHelper::FRAMING_16BIT),
+    m_encoding(Peer::JSON_ENCODING),
+    m_compression(false),
+    m_compressionThreshold(1024),
+    m_maxInFlightRequests(0),
+    m_maxBufferedBytes(0),
+    m_maxMessageSize(16 * 1024 * 1024),
+    m_methodRegistry(new MethodRegistry(this)),
+    m_metrics(NULL),
+    nextWorkerIndex(0),
+    localListener(NULL)
+{
+    qRegisterMetaType< QSharedPointer<JsonRPC::ResponseHandler> >
+            ("QSharedPointer<JsonRPC::ResponseHandler>");
+}
+
+TcpServer::~TcpServer()
+{
+    close();
+    closeLocal();
+
+    // stops the threads before the registry is destroyed
+    qDeleteAll(workers);
+}
+
+bool TcpServer::listenLocal(const QString &name)
+{
+    closeLocal();
+
+    localListener = new TcpServerLocalListener(this);
+    if (!localListener->listen(name)) {
+        closeLocal();
+        return false;
+    }
+
+    return true;
+}
+
+QString TcpServer::localServerName() const
+{
+    return localListener ? localListener->fullServerName() : QString();
+}
+
+void TcpServer::closeLocal()
+{
+    delete localListener;
+    localListener = NULL;
+}
+
+int TcpServer::threadCount() const
+{
+    return m_threadCount;
+}
+
+void TcpServer::setThreadCount(int count)
+{
+    if (count > 0)
+        m_threadCount = count;
+}
+
+TcpServer::LoadBalancing TcpServer::loadBalancing() const
+{
+    return m_loadBalancing;
+}
+
+void TcpServer::setLoadBalancing(LoadBalancing policy)
+{
+    m_loadBalancing = policy;
+}
+
+TcpHelper::Framing TcpServer::framing() const
+{
+    return m_framing;
+}
+
+void TcpServer::setFraming(TcpHelper::Framing framing)
+{
+    m_framing = framing;
+}
+
+Peer::Encoding TcpServer::encoding() const
+{
+    return m_encoding;
+}
+
+void TcpServer::setEncoding(Peer::Encoding encoding)
+{
+    m_encoding = encoding;
+}
+
+bool TcpServer::compression() const
+{
+    return m_compression;
+}
+
+void TcpServer::setCompression(bool enabled)
+{
+    m_compression = enabled;
+}
+
+int TcpServer::compressionThreshold() const
+{
+    return m_compressionThreshold;
+}
+
+void TcpServer::setCompressionThreshold(int size)
+{
+    m_compressionThreshold = qMax(0, size);
+}
+
+int TcpServer::maxInFlightRequests() const
+{
+    return m_maxInFlightRequests;
+}
+
+void TcpServer::setMaxInFlightRequests(int max)
+{
+    m_maxInFlightRequests = qMax(0, max);
+}
+
+qint64 TcpServer::maxBufferedBytes() const
+{
+    return m_maxBufferedBytes;
+}
+
+void TcpServer::setMaxBufferedBytes(qint64 max)
+{
+    m_maxBufferedBytes = qMax(qint64(0), max);
+}
+
+int TcpServer::maxMessageSize() const
+{
+    return m_maxMessageSize;
+}
+
+void TcpServer::setMaxMessageSize(int size)
+{
+    m_maxMessageSize = qMax(0, size);
+}
+
+MethodRegistry *TcpServer::methodRegistry() const
+{
+    return m_methodRegistry;
+}
+
+bool TcpServer::registerMethod(const QString &name, QObject *receiver,
+                               const char *member,
+                               MethodRegistry::ExecutionMode mode)
+{
+    return m_methodRegistry->registerMethod(name, receiver, member, mode);
+}
+
+bool TcpServer::registerMethod(const QString &name, AbstractMethod *method,
+                               MethodRegistry::ExecutionMode mode)
+{
+    return m_methodRegistry->registerMethod(name, method, mode);
+}
+
+Metrics *TcpServer::metrics() const
+{
+    return m_metrics;
+}
+
+void TcpServer::setMetrics(Metrics *metrics)
+{
+    m_metrics = metrics;
+}
+
+int TcpServer::connectionCount() const
+{
+    int count = 0;
+    Q_FOREACH (TcpServerWorker *worker, workers)
+        count += worker->connections;
+    return count;
+}
+
+QList<int> TcpServer::threadConnectionCounts() const
+{
+    QList<int> counts;
+    Q_FOREACH (TcpServerWorker *worker, workers)
+        counts.push_back(worker->connections);
+    return counts;
+}
+
+void TcpServer::incomingConnection(int socketDescriptor)
+{
+    addConnection(socketDescriptor, false);
+}
+
+void TcpServer::addConnection(qlonglong socketDescriptor, bool local)
+{
+    if (workers.isEmpty())
+        startWorkers();
+
+    TcpServerWorker *worker = nextWorker();
+    worker->connections.ref();
+
+    const int framing = m_framing;
+    const int encoding = m_encoding;
+    const bool compression = m_compression;
+    const int compressionThreshold = m_compressionThreshold;
+    const int maxInFlightRequests = m_maxInFlightRequests;
+    const qlonglong maxBufferedBytes = m_maxBufferedBytes;
+    const int maxMessageSize = m_maxMessageSize;
+
+    QMetaObject::invokeMethod(worker, "addConnection", Qt::QueuedConnection,
+                              Q_ARG(qlonglong, socketDescriptor),
+                              Q_ARG(bool, local),
+                              Q_ARG(int, framing),
+                              Q_ARG(int, encoding),
+                              Q_ARG(bool, compression),
+                              Q_ARG(int, compressionThreshold),
+                              Q_ARG(int, maxInFlightRequests),
+                              Q_ARG(qlonglong, maxBufferedBytes),
+                              Q_ARG(int, maxMessageSize));
+}
+
+bool TcpServer::forwardsRequests() const
+{
+    return receivers(SIGNAL(readyRequest(QSharedPointer<JsonRPC::ResponseHandler>)));
+}
+
+void TcpServer::startWorkers()
+{
+    for (int i = 0;i != m_threadCount;++i)
+        workers.push_back(new TcpServerWorker(this));
+}
+
+TcpServerWorker *TcpServer::nextWorker()
+{
+    if (m_loadBalancing == ROUND_ROBIN) {
+        TcpServerWorker *worker = workers[nextWorkerIndex];
+        nextWorkerIndex = (nextWorkerIndex + 1) % workers.size();
+        return worker;
+    }
+
+    TcpServerWorker *worker = workers.first();
+    Q_FOREACH (TcpServerWorker *candidate, workers) {
+        if (candidate->connections < worker->connections)
+            worker = candidate;
+    }
+    return worker;
+}
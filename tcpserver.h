@@ -0,0 +1,268 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_TCPSERVER_H
+#define QTJSONRPC_TCPSERVER_H
+
+#include <QTcpServer>
+#include <QList>
+
+#include "tcphelper.h"
+
+namespace JsonRPC {
+
+class TcpServerLocalListener;
+class TcpServerWorker;
+
+/*!
+  TcpServer accepts JSON-RPC connections (using the TcpHelper protocol)
+  and spreads them among a set of worker threads, each one running its
+  own event loop.
+  All connections share the same MethodRegistry, so the methods only need
+  to be registered once.
+  Requests for methods that aren't in the registry are emitted through
+  the readyRequest signal, in the thread of the server. If nothing is
+  connected to this signal, they are answered with a METHOD_NOT_FOUND
+  error. This is checked for each request, so the signal can be
+  connected at any time.
+  Besides the TCP port, the server can also accept connections through a
+  local socket (see listenLocal), handled by the same worker threads
+  with the same settings.
+  @warning the registered methods are called from the worker threads, so
+  they must be thread-safe.
+  */
+class TcpServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    /*!
+      How a worker thread is chosen for a new connection.
+      */
+    enum LoadBalancing
+    {
+        /*! The worker threads are used in turns. */
+        ROUND_ROBIN,
+        /*! The worker thread with fewer connections is used. */
+        LEAST_CONNECTIONS
+    };
+
+    explicit TcpServer(QObject *parent = 0);
+    /*!
+      Closes all connections and stops the worker threads.
+      */
+    ~TcpServer();
+
+    /*!
+      Listens for connections on the local socket \param name, in
+      addition to the TCP port. The clients connect with a QLocalSocket
+      and use TcpHelper::setLocalSocket.
+      On Unix, a stale socket file left by a crashed server makes it
+      fail, see QLocalServer::removeServer.
+      @return true on success.
+      @sa QLocalServer::listen
+      */
+    bool listenLocal(const QString &name);
+    /*!
+      @return the full path of the local socket, or an empty string if
+      the server isn't listening on a local socket.
+      */
+    QString localServerName() const;
+    /*!
+      Stops listening on the local socket. The open connections aren't
+      closed.
+      */
+    void closeLocal();
+
+    /*!
+      @return the number of worker threads.
+      */
+    int threadCount() const;
+    /*! Sets the number of worker threads.
+      The default is QThread::idealThreadCount().
+      It only takes effect if it's called before the first connection is
+      accepted.
+      */
+    void setThreadCount(int count);
+
+    /*!
+      @return the policy used to choose the thread of new connections.
+      */
+    LoadBalancing loadBalancing() const;
+    /*!
+      Sets the policy used to choose the thread of new connections.
+      The default is LEAST_CONNECTIONS.
+      */
+    void setLoadBalancing(LoadBalancing policy);
+
+    /*!
+      @return the framing mode used by new connections.
+      */
+    TcpHelper::Framing framing() const;
+    /*!
+      Sets the framing mode used by new connections.
+      @sa TcpHelper::setFraming
+      */
+    void setFraming(TcpHelper::Framing framing);
+
+    /*!
+      @return the preferred encoding of new connections.
+      */
+    Peer::Encoding encoding() const;
+    /*!
+      Sets the preferred encoding of new connections.
+      @sa TcpHelper::setEncoding
+      */
+    void setEncoding(Peer::Encoding encoding);
+
+    /*!
+      @return true if new connections can compress the large messages.
+      */
+    bool compression() const;
+    /*!
+      Sets whether new connections can compress the large messages.
+      @sa TcpHelper::setCompression
+      */
+    void setCompression(bool enabled);
+    /*!
+      @return the minimum size of the messages compressed by new
+      connections.
+      */
+    int compressionThreshold() const;
+    /*!
+      Sets the minimum size of the messages compressed by new
+      connections.
+      @sa TcpHelper::setCompressionThreshold
+      */
+    void setCompressionThreshold(int size);
+
+    /*!
+      @return the maximum number of requests of each connection waiting
+      for a response, or 0 if there is no limit.
+      */
+    int maxInFlightRequests() const;
+    /*!
+      Sets the maximum number of requests of each new connection waiting
+      for a response.
+      @sa TcpHelper::setMaxInFlightRequests
+      */
+    void setMaxInFlightRequests(int max);
+    /*!
+      @return the maximum number of outbound bytes of each connection
+      waiting to be written, or 0 if there is no limit.
+      */
+    qint64 maxBufferedBytes() const;
+    /*!
+      Sets the maximum number of outbound bytes of each new connection
+      waiting to be written.
+      @sa TcpHelper::setMaxBufferedBytes
+      */
+    void setMaxBufferedBytes(qint64 max);
+    /*!
+      @return the maximum size of a message received by each connection,
+      or 0 if there is no limit.
+      */
+    int maxMessageSize() const;
+    /*!
+      Sets the maximum size of a message received by each new connection.
+      The default is 16 MiB.
+      @sa TcpHelper::setMaxMessageSize
+      */
+    void setMaxMessageSize(int size);
+
+    /*!
+      @return the registry shared by all connections.
+      */
+    MethodRegistry *methodRegistry() const;
+    /*!
+      Registers the method \param name in the registry shared by all
+      connections.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, QObject *receiver,
+                        const char *member,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the method \param name in the registry shared by all
+      connections.
+      @sa MethodRegistry::registerMethod
+      */
+    bool registerMethod(const QString &name, AbstractMethod *method,
+                        MethodRegistry::ExecutionMode mode
+                        = MethodRegistry::DIRECT_EXECUTION);
+    /*!
+      Registers the function \param function as the method \param name
+      in the registry shared by all connections.
+      @sa MethodRegistry::registerFunction
+      */
+    template<typename Function>
+    bool registerFunction(const QString &name, Function function,
+                          const QStringList &names = QStringList(),
+                          MethodRegistry::ExecutionMode mode
+                          = MethodRegistry::DIRECT_EXECUTION)
+    {
+        return m_methodRegistry->registerFunction(name, function, names, mode);
+    }
+
+    /*!
+      @return the object where the requests of all connections are
+      recorded, or NULL if none.
+      */
+    Metrics *metrics() const;
+    /*!
+      Sets the object where the requests of all connections are recorded
+      to \param metrics. The server doesn't take the ownership of
+      \param metrics. It's applied to new connections.
+      @sa Peer::setMetrics
+      */
+    void setMetrics(Metrics *metrics);
+
+    /*!
+      @return the number of open connections.
+      */
+    int connectionCount() const;
+    /*!
+      @return the number of open connections of each worker thread.
+      */
+    QList<int> threadConnectionCounts() const;
+
+signals:
+    /*!
+      Emitted when a new request message is available and its method
+      isn't in the method registry.
+      /param handler is the object that you use to send a response.
+      */
+    void readyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+
+protected:
+    void incomingConnection(int socketDescriptor);
+
+private:
+    friend class TcpServerLocalListener;
+    friend class TcpServerWorker;
+
+    void addConnection(qlonglong socketDescriptor, bool local);
+    // it can be called from the worker threads
+    bool forwardsRequests() const;
+    void startWorkers();
+    TcpServerWorker *nextWorker();
+
+    int m_threadCount;
+    LoadBalancing m_loadBalancing;
+    TcpHelper::Framing m_framing;
+    Peer::Encoding m_encoding;
+    bool m_compression;
+    int m_compressionThreshold;
+    int m_maxInFlightRequests;
+    qint64 m_maxBufferedBytes;
+    int m_maxMessageSize;
+    MethodRegistry *m_methodRegistry;
+    Metrics *m_metrics;
+
+    QList<TcpServerWorker *> workers;
+    int nextWorkerIndex;
+    TcpServerLocalListener *localListener;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_TCPSERVER_H
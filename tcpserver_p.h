@@ -0,0 +1,79 @@
+//  Copyright © 2011  Vinícius dos Santos Oliveira
+
+#ifndef QTJSONRPC_TCPSERVER_P_H
+#define QTJSONRPC_TCPSERVER_P_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QLocalServer>
+
+#include <QSharedPointer>
+
+class QThread;
+
+namespace JsonRPC {
+
+class ResponseHandler;
+class TcpServer;
+
+/*!
+  Owns the connections of one worker thread of a TcpServer.
+  It lives in its own thread, so all slots run in that thread.
+  @warning this file is private, it should be included only by
+  tcpserver.cpp
+  */
+class TcpServerWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TcpServerWorker(TcpServer *server);
+    ~TcpServerWorker();
+
+    /*!
+      Number of open connections. It's incremented by the server when a
+      connection is assigned to this worker, so the load balancing sees it
+      immediately.
+      */
+    QAtomicInt connections;
+
+public slots:
+    void addConnection(qlonglong socketDescriptor, bool local, int framing,
+                       int encoding, bool compression,
+                       int compressionThreshold, int maxInFlightRequests,
+                       qlonglong maxBufferedBytes, int maxMessageSize);
+
+signals:
+    void readyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+
+private slots:
+    void onReadyRequest(QSharedPointer<JsonRPC::ResponseHandler> handler);
+    void onDisconnected();
+    void closeConnections();
+
+private:
+    TcpServer *server;
+    QThread *thread;
+};
+
+/*!
+  Accepts the local socket connections of a TcpServer and passes their
+  descriptors to the server, like the TCP connections.
+  @warning this file is private, it should be included only by
+  tcpserver.cpp
+  */
+class TcpServerLocalListener : public QLocalServer
+{
+    Q_OBJECT
+public:
+    explicit TcpServerLocalListener(TcpServer *server);
+
+protected:
+    void incomingConnection(quintptr socketDescriptor);
+
+private:
+    TcpServer *server;
+};
+
+} // namespace JsonRPC
+
+#endif // QTJSONRPC_TCPSERVER_P_H